@@ -26,6 +26,7 @@
 #define _GNU_SOURCE
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -79,6 +80,24 @@ create_tmpfile_cloexec(char *tmpname)
 	return fd;
 }
 
+static int
+allocate_file(int fd, off_t size)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+	int ret;
+
+	ret = posix_fallocate(fd, 0, size);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+#else
+	return ftruncate(fd, size);
+#endif
+}
+
 /*
  * Create a new, unique, anonymous file of the given size, and
  * return the file descriptor for it. The file descriptor is set
@@ -99,6 +118,10 @@ create_tmpfile_cloexec(char *tmpname)
  * given size. If disk space is insufficent, errno is set to ENOSPC.
  * If posix_fallocate() is not supported, program may receive
  * SIGBUS on accessing mmap()'ed file contents instead.
+ *
+ * Where memfd_create() is available, the file is a memfd sealed
+ * against shrinking, which lets the compositor skip its SIGBUS
+ * protection when accessing it. The file can still grow.
  */
 int
 os_create_anonymous_file(off_t size)
@@ -109,6 +132,23 @@ os_create_anonymous_file(off_t size)
 	int fd;
 	int ret;
 
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("wayland-cursor", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		/* Seal only once the file has its final size, as the
+		 * seal also forbids truncating it down to size */
+		ret = allocate_file(fd, size);
+		if (ret == 0 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+			ret = -1;
+		if (ret < 0) {
+			close(fd);
+			return -1;
+		}
+
+		return fd;
+	}
+#endif
+
 	path = getenv("XDG_RUNTIME_DIR");
 	if (!path) {
 		errno = ENOENT;
@@ -129,20 +169,10 @@ os_create_anonymous_file(off_t size)
 	if (fd < 0)
 		return -1;
 
-#ifdef HAVE_POSIX_FALLOCATE
-	ret = posix_fallocate(fd, 0, size);
-	if (ret != 0) {
+	if (allocate_file(fd, size) < 0) {
 		close(fd);
-		errno = ret;
 		return -1;
 	}
-#else
-	ret = ftruncate(fd, size);
-	if (ret < 0) {
-		close(fd);
-		return -1;
-	}
-#endif
 
 	return fd;
 }
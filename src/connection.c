@@ -44,8 +44,6 @@
 #include "wayland-private.h"
 #include "wayland-os.h"
 
-#define DIV_ROUNDUP(n, a) ( ((n) + ((a) - 1)) / (a) )
-
 struct wl_buffer {
 	char data[4096];
 	uint32_t head, tail;
@@ -56,11 +54,35 @@ struct wl_buffer {
 #define MAX_FDS_OUT	28
 #define CLEN		(CMSG_LEN(MAX_FDS_OUT * sizeof(int32_t)))
 
+/* Demarshalled closures that fit in CLOSURE_CACHE_SIZE bytes are all
+ * allocated at that size, so that once dispatched they can be kept on
+ * the connection and reused for any later small message.  Most events
+ * (pointer motion, keys, frame callbacks) fall in this class. */
+#define CLOSURE_CACHE_SIZE	192
+#define CLOSURE_CACHE_MAX	128
+
+/* Data queued behind full out buffers, in order.  A chunk fits in the
+ * out buffers once they have drained, and its fds belong to its own
+ * messages or to earlier ones, so they never arrive after them. */
+struct wl_overflow {
+	struct wl_list link;
+	char data[4096];
+	uint32_t size;
+	int32_t fds[MAX_FDS_OUT];
+	int nfds;
+};
+
 struct wl_connection {
 	struct wl_buffer in, out;
 	struct wl_buffer fds_in, fds_out;
 	int fd;
 	int want_flush;
+	int queue_when_full;
+	struct wl_list overflow;
+	uint32_t overflow_size;
+	struct wl_list closure_cache;
+	int closure_cache_count;
+	struct wl_connection_stats stats;
 };
 
 static int
@@ -168,6 +190,8 @@ wl_connection_create(int fd)
 		return NULL;
 
 	connection->fd = fd;
+	wl_list_init(&connection->closure_cache);
+	wl_list_init(&connection->overflow);
 
 	return connection;
 }
@@ -194,10 +218,19 @@ close_fds(struct wl_buffer *buffer, int max)
 int
 wl_connection_destroy(struct wl_connection *connection)
 {
-	int fd = connection->fd;
+	struct wl_closure *closure, *next;
+	struct wl_overflow *chunk, *tmp;
+	int fd = connection->fd, i;
 
 	close_fds(&connection->fds_out, -1);
 	close_fds(&connection->fds_in, -1);
+	wl_list_for_each_safe(chunk, tmp, &connection->overflow, link) {
+		for (i = 0; i < chunk->nfds; i++)
+			close(chunk->fds[i]);
+		free(chunk);
+	}
+	wl_list_for_each_safe(closure, next, &connection->closure_cache, link)
+		free(closure);
 	free(connection);
 
 	return fd;
@@ -270,20 +303,43 @@ decode_cmsg(struct wl_buffer *buffer, struct msghdr *msg)
 	return 0;
 }
 
+/* Move the first overflow chunk into the drained out buffers */
+static void
+wl_connection_refill(struct wl_connection *connection)
+{
+	struct wl_overflow *chunk;
+
+	chunk = wl_container_of(connection->overflow.next, chunk, link);
+	wl_buffer_put(&connection->out, chunk->data, chunk->size);
+	wl_buffer_put(&connection->fds_out, chunk->fds,
+		      chunk->nfds * sizeof chunk->fds[0]);
+	connection->overflow_size -= chunk->size;
+
+	wl_list_remove(&chunk->link);
+	free(chunk);
+}
+
 int
 wl_connection_flush(struct wl_connection *connection)
 {
 	struct iovec iov[2];
 	struct msghdr msg;
 	char cmsg[CLEN];
-	int len = 0, count, clen;
-	uint32_t tail;
+	int len = 0, count, clen, sent = 0;
 
 	if (!connection->want_flush)
 		return 0;
 
-	tail = connection->out.tail;
-	while (connection->out.head - connection->out.tail > 0) {
+	if (wl_connection_pending_output(connection) > 0)
+		connection->stats.flushes++;
+
+	while (1) {
+		if (connection->out.head == connection->out.tail) {
+			if (wl_list_empty(&connection->overflow))
+				break;
+			wl_connection_refill(connection);
+		}
+
 		wl_buffer_get_iov(&connection->out, iov, &count);
 
 		build_cmsg(&connection->fds_out, cmsg, &clen);
@@ -301,17 +357,22 @@ wl_connection_flush(struct wl_connection *connection)
 				      MSG_NOSIGNAL | MSG_DONTWAIT);
 		} while (len == -1 && errno == EINTR);
 
-		if (len == -1)
+		if (len == -1) {
+			if (errno == EAGAIN)
+				connection->stats.flushes_eagain++;
 			return -1;
+		}
 
 		close_fds(&connection->fds_out, MAX_FDS_OUT);
 
 		connection->out.tail += len;
+		connection->stats.bytes_out += len;
+		sent += len;
 	}
 
 	connection->want_flush = 0;
 
-	return connection->out.head - tail;
+	return sent;
 }
 
 uint32_t
@@ -320,6 +381,98 @@ wl_connection_pending_input(struct wl_connection *connection)
 	return wl_buffer_size(&connection->in);
 }
 
+uint32_t
+wl_connection_pending_output(struct wl_connection *connection)
+{
+	return wl_buffer_size(&connection->out) + connection->overflow_size;
+}
+
+void
+wl_connection_get_stats(struct wl_connection *connection,
+			struct wl_connection_stats *stats)
+{
+	*stats = connection->stats;
+}
+
+/* When set, data that doesn't fit in the out buffers while the socket
+ * is full is queued behind them until a later flush, instead of failing
+ * with EAGAIN. */
+void
+wl_connection_set_queue_when_full(struct wl_connection *connection,
+				  int queue)
+{
+	connection->queue_when_full = queue;
+}
+
+/* Flush to make room in the out buffers.  A full socket is no error if
+ * the connection queues data behind them. */
+static int
+wl_connection_make_room(struct wl_connection *connection)
+{
+	connection->want_flush = 1;
+	if (wl_connection_flush(connection) < 0 &&
+	    (errno != EAGAIN || !connection->queue_when_full))
+		return -1;
+
+	return 0;
+}
+
+/* Get the overflow chunk with room for count more bytes and nfds more
+ * fds, adding a new one if the last chunk is full */
+static struct wl_overflow *
+wl_connection_overflow_tail(struct wl_connection *connection,
+			    size_t count, int nfds)
+{
+	struct wl_overflow *chunk;
+
+	if (!wl_list_empty(&connection->overflow)) {
+		chunk = wl_container_of(connection->overflow.prev, chunk, link);
+		if (chunk->size + count <= sizeof chunk->data &&
+		    chunk->nfds + nfds <= MAX_FDS_OUT)
+			return chunk;
+	}
+
+	chunk = zalloc(sizeof *chunk);
+	if (chunk == NULL)
+		return NULL;
+	wl_list_insert(connection->overflow.prev, &chunk->link);
+
+	return chunk;
+}
+
+static int
+wl_connection_overflow(struct wl_connection *connection,
+		       const void *data, size_t count)
+{
+	struct wl_overflow *chunk;
+
+	if (count > sizeof chunk->data) {
+		wl_log("Data too big for buffer (%d > %d).\n",
+		       count, sizeof chunk->data);
+		errno = E2BIG;
+		return -1;
+	}
+
+	chunk = wl_connection_overflow_tail(connection, count, 0);
+	if (chunk == NULL)
+		return -1;
+
+	memcpy(chunk->data + chunk->size, data, count);
+	chunk->size += count;
+	connection->overflow_size += count;
+
+	return 0;
+}
+
+/* Whether count more bytes have to go behind the out buffer */
+static int
+wl_connection_must_overflow(struct wl_connection *connection, size_t count)
+{
+	return !wl_list_empty(&connection->overflow) ||
+		connection->out.head - connection->out.tail +
+		count > ARRAY_LENGTH(connection->out.data);
+}
+
 int
 wl_connection_read(struct wl_connection *connection)
 {
@@ -355,6 +508,7 @@ wl_connection_read(struct wl_connection *connection)
 		return -1;
 
 	connection->in.head += len;
+	connection->stats.bytes_in += len;
 
 	return wl_connection_pending_input(connection);
 }
@@ -363,14 +517,7 @@ int
 wl_connection_write(struct wl_connection *connection,
 		    const void *data, size_t count)
 {
-	if (connection->out.head - connection->out.tail +
-	    count > ARRAY_LENGTH(connection->out.data)) {
-		connection->want_flush = 1;
-		if (wl_connection_flush(connection) < 0)
-			return -1;
-	}
-
-	if (wl_buffer_put(&connection->out, data, count) < 0)
+	if (wl_connection_queue(connection, data, count) < 0)
 		return -1;
 
 	connection->want_flush = 1;
@@ -382,16 +529,148 @@ int
 wl_connection_queue(struct wl_connection *connection,
 		    const void *data, size_t count)
 {
-	if (connection->out.head - connection->out.tail +
-	    count > ARRAY_LENGTH(connection->out.data)) {
-		connection->want_flush = 1;
-		if (wl_connection_flush(connection) < 0)
+	if (wl_connection_must_overflow(connection, count) &&
+	    wl_list_empty(&connection->overflow)) {
+		if (wl_connection_make_room(connection) < 0)
 			return -1;
 	}
 
+	if (wl_connection_must_overflow(connection, count))
+		return wl_connection_overflow(connection, data, count);
+
 	return wl_buffer_put(&connection->out, data, count);
 }
 
+static int
+export_buffer(struct wl_buffer *b, struct wl_array *state)
+{
+	uint32_t *p, size;
+
+	size = wl_buffer_size(b);
+	p = wl_array_add(state, (1 + DIV_ROUNDUP(size, sizeof *p)) * sizeof *p);
+	if (p == NULL)
+		return -1;
+
+	*p++ = size;
+	wl_buffer_copy(b, p, size);
+
+	return 0;
+}
+
+/* Move everything the connection has buffered, and its socket, into
+ * state and fds so that another process can take over the connection
+ * with wl_connection_import().  The socket fd is appended to fds first,
+ * followed by the fds queued for reading and for writing.  On success
+ * the connection no longer owns any of those fds. */
+int
+wl_connection_export(struct wl_connection *connection,
+		     struct wl_array *state, struct wl_array *fds)
+{
+	size_t state_size = state->size, fds_size = fds->size;
+	uint32_t *p;
+	int *fd;
+
+	/* The state has no room for data queued behind the out buffer */
+	if (!wl_list_empty(&connection->overflow)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	p = wl_array_add(state, 2 * sizeof *p);
+	if (p == NULL)
+		return -1;
+	p[0] = wl_buffer_size(&connection->fds_in) / sizeof(int32_t);
+	p[1] = wl_buffer_size(&connection->fds_out) / sizeof(int32_t);
+
+	if (export_buffer(&connection->in, state) < 0 ||
+	    export_buffer(&connection->out, state) < 0)
+		goto err;
+
+	fd = wl_array_add(fds, sizeof *fd + wl_buffer_size(&connection->fds_in) +
+			  wl_buffer_size(&connection->fds_out));
+	if (fd == NULL)
+		goto err;
+
+	*fd++ = connection->fd;
+	wl_buffer_copy(&connection->fds_in, fd,
+		       wl_buffer_size(&connection->fds_in));
+	fd += wl_buffer_size(&connection->fds_in) / sizeof *fd;
+	wl_buffer_copy(&connection->fds_out, fd,
+		       wl_buffer_size(&connection->fds_out));
+
+	connection->in.tail = connection->in.head;
+	connection->out.tail = connection->out.head;
+	connection->fds_in.tail = connection->fds_in.head;
+	connection->fds_out.tail = connection->fds_out.head;
+	connection->want_flush = 0;
+	connection->fd = -1;
+
+	return 0;
+
+err:
+	state->size = state_size;
+	fds->size = fds_size;
+	errno = ENOMEM;
+	return -1;
+}
+
+static const uint32_t *
+import_buffer(struct wl_buffer *b, const uint32_t *p, const uint32_t *end,
+	      int check_only)
+{
+	uint32_t size;
+
+	if (p + 1 > end)
+		return NULL;
+
+	size = *p++;
+	if (size > sizeof b->data || DIV_ROUNDUP(size, sizeof *p) > (size_t) (end - p))
+		return NULL;
+
+	if (!check_only)
+		wl_buffer_put(b, p, size);
+
+	return p + DIV_ROUNDUP(size, sizeof *p);
+}
+
+/* Load state produced by wl_connection_export() into a freshly
+ * created connection.  fds are the fds that followed the socket fd;
+ * they are only taken over if the whole state is valid.  Returns a
+ * pointer past the consumed state, or NULL if it is malformed. */
+const uint32_t *
+wl_connection_import(struct wl_connection *connection,
+		     const uint32_t *p, const uint32_t *end,
+		     const int *fds, int nfds)
+{
+	uint32_t nfds_in, nfds_out;
+	const uint32_t *in, *out;
+
+	if (p + 2 > end)
+		return NULL;
+
+	nfds_in = p[0];
+	nfds_out = p[1];
+	if (nfds_in > sizeof connection->fds_in.data / sizeof *fds ||
+	    nfds_out > sizeof connection->fds_out.data / sizeof *fds ||
+	    (int) (nfds_in + nfds_out) != nfds)
+		return NULL;
+
+	in = p + 2;
+	out = import_buffer(&connection->in, in, end, 1);
+	if (out == NULL || import_buffer(&connection->out, out, end, 1) == NULL)
+		return NULL;
+
+	import_buffer(&connection->in, in, end, 0);
+	p = import_buffer(&connection->out, out, end, 0);
+	wl_buffer_put(&connection->fds_in, fds, nfds_in * sizeof *fds);
+	wl_buffer_put(&connection->fds_out, fds + nfds_in,
+		      nfds_out * sizeof *fds);
+	if (wl_buffer_size(&connection->out) > 0)
+		connection->want_flush = 1;
+
+	return p;
+}
+
 static int
 wl_message_count_arrays(const struct wl_message *message)
 {
@@ -414,12 +693,25 @@ wl_connection_get_fd(struct wl_connection *connection)
 static int
 wl_connection_put_fd(struct wl_connection *connection, int32_t fd)
 {
-	if (wl_buffer_size(&connection->fds_out) == MAX_FDS_OUT * sizeof fd) {
-		connection->want_flush = 1;
-		if (wl_connection_flush(connection) < 0)
+	struct wl_overflow *chunk;
+
+	if (wl_list_empty(&connection->overflow) &&
+	    wl_buffer_size(&connection->fds_out) == MAX_FDS_OUT * sizeof fd) {
+		if (wl_connection_make_room(connection) < 0)
 			return -1;
 	}
 
+	/* Messages are written after their fds, so once an fd goes
+	 * behind the out buffers its message follows it there. */
+	if (!wl_list_empty(&connection->overflow) ||
+	    wl_buffer_size(&connection->fds_out) == MAX_FDS_OUT * sizeof fd) {
+		chunk = wl_connection_overflow_tail(connection, 0, 1);
+		if (chunk == NULL)
+			return -1;
+		chunk->fds[chunk->nfds++] = fd;
+		return 0;
+	}
+
 	return wl_buffer_put(&connection->fds_out, &fd, sizeof fd);
 }
 
@@ -523,6 +815,32 @@ wl_argument_from_va_list(const char *signature, union wl_argument *args,
 	}
 }
 
+static struct wl_closure *
+closure_alloc(struct wl_connection *connection, size_t size)
+{
+	struct wl_closure *closure;
+
+	if (connection && size <= CLOSURE_CACHE_SIZE) {
+		if (!wl_list_empty(&connection->closure_cache)) {
+			closure = container_of(connection->closure_cache.next,
+					       struct wl_closure, link);
+			wl_list_remove(&closure->link);
+			connection->closure_cache_count--;
+			return closure;
+		}
+
+		size = CLOSURE_CACHE_SIZE;
+	}
+
+	closure = malloc(size);
+	if (closure == NULL)
+		return NULL;
+
+	closure->alloc = size;
+
+	return closure;
+}
+
 struct wl_closure *
 wl_closure_marshal(struct wl_object *sender, uint32_t opcode,
 		   union wl_argument *args,
@@ -541,12 +859,13 @@ wl_closure_marshal(struct wl_object *sender, uint32_t opcode,
 		return NULL;
 	}
 
-	closure = malloc(sizeof *closure);
+	closure = closure_alloc(NULL, sizeof *closure + count * sizeof *args);
 	if (closure == NULL) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
+	closure->args = (union wl_argument *) closure->extra;
 	memcpy(closure->args, args, count * sizeof *args);
 
 	signature = message->signature;
@@ -642,7 +961,9 @@ wl_connection_demarshal(struct wl_connection *connection,
 	}
 
 	num_arrays = wl_message_count_arrays(message);
-	closure = malloc(sizeof *closure + size + num_arrays * sizeof *array);
+	closure = closure_alloc(connection, sizeof *closure +
+				num_arrays * sizeof *array +
+				count * sizeof *closure->args + size);
 	if (closure == NULL) {
 		errno = ENOMEM;
 		wl_connection_consume(connection, size);
@@ -650,7 +971,8 @@ wl_connection_demarshal(struct wl_connection *connection,
 	}
 
 	array_extra = closure->extra;
-	p = (uint32_t *)(closure->extra + num_arrays);
+	closure->args = (union wl_argument *) (closure->extra + num_arrays);
+	p = (uint32_t *) (closure->args + count);
 	end = p + size / sizeof *p;
 
 	wl_connection_copy(connection, p, size);
@@ -791,7 +1113,7 @@ wl_connection_demarshal(struct wl_connection *connection,
 	return closure;
 
  err:
-	wl_closure_destroy(closure);
+	wl_closure_recycle(closure, connection);
 	wl_connection_consume(connection, size);
 
 	return NULL;
@@ -1253,3 +1575,19 @@ wl_closure_destroy(struct wl_closure *closure)
 {
 	free(closure);
 }
+
+/* Release a closure that came from wl_connection_demarshal(), keeping
+ * it around for reuse by the next small message on the connection. */
+void
+wl_closure_recycle(struct wl_closure *closure,
+		   struct wl_connection *connection)
+{
+	if (closure->alloc != CLOSURE_CACHE_SIZE ||
+	    connection->closure_cache_count >= CLOSURE_CACHE_MAX) {
+		free(closure);
+		return;
+	}
+
+	wl_list_insert(&connection->closure_cache, &closure->link);
+	connection->closure_cache_count++;
+}
@@ -30,9 +30,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
@@ -40,14 +42,8 @@
 #include "wayland-server.h"
 #include "wayland-os.h"
 
-struct wl_event_loop {
-	int epoll_fd;
-	struct wl_list check_list;
-	struct wl_list idle_list;
-	struct wl_list destroy_list;
-
-	struct wl_signal destroy_signal;
-};
+#define EVENT_BATCH_MIN		32
+#define EVENT_BATCH_LIMIT	1024
 
 struct wl_event_source_interface {
 	int (*dispatch)(struct wl_event_source *source,
@@ -60,8 +56,136 @@ struct wl_event_source {
 	struct wl_list link;
 	void *data;
 	int fd;
+	int priority;
+	uint32_t events;
+
+	uint64_t dispatch_count;
+	uint64_t dispatch_ns, dispatch_max_ns;
+
+	struct wl_list deferred_link;
+	uint32_t deferred_events;
+	/* Taken out of epoll while deferred, so that a level-triggered
+	 * fd doesn't keep waking up the loop. */
+	int suspended;
+};
+
+struct wl_event_source_timer;
+
+/* All timers of a loop share one timerfd, armed for the earliest
+ * deadline in a binary min-heap.  Arming or disarming a timer only
+ * touches the timerfd when the earliest deadline changes. */
+struct wl_timer_heap {
+	struct wl_event_source base;
+	struct wl_event_source_timer **data;
+	int space, count;
+};
+
+struct wl_event_loop_task {
+	struct wl_event_loop_task *next;
+	wl_event_loop_task_func_t func;
+	void *data;
+};
+
+struct wl_event_loop {
+	int epoll_fd;
+	struct wl_list check_list;
+	struct wl_list idle_list;
+	struct wl_list idle_task_list;
+	struct wl_list destroy_list;
+
+	struct wl_timer_heap timers;
+
+	/* One signalfd, created with the first signal source, whose
+	 * mask covers the signals of every source on signal_list. */
+	struct wl_event_source signal_source;
+	struct wl_list signal_list;
+	uint32_t signal_serial;
+
+	/* High priority sources live in a nested epoll set, so they are
+	 * found even when more than one batch of events is ready. */
+	struct wl_event_source high_source;
+
+	/* Tasks posted from other threads, newest first, and the
+	 * eventfd that wakes up the loop when the stack was empty. */
+	struct wl_event_source post_source;
+	struct wl_event_loop_task *posted;
+
+	/* Busy polling: after activity, poll without blocking for up to
+	 * busy_poll_ns before falling back to a blocking epoll_wait(). */
+	uint64_t busy_poll_ns;
+	int busy_poll_armed;
+	uint64_t spin_ns, sleep_ns;
+
+	/* Dispatch time accounting, only done while profiling is set. */
+	int profiling;
+	uint64_t wait_ns, idle_ns;
+
+	/* Once deadline_ns (the repaint deadline minus its margin) has
+	 * passed, normal priority sources are put on deferred_list
+	 * instead of being dispatched. */
+	int has_deadline;
+	uint64_t deadline_ns;
+	struct wl_list deferred_list;
+
+	/* The epoll batch starts on the stack and moves to events, doubling
+	 * up to batch_limit, whenever a wait fills it.  Dispatch starts
+	 * at a rotating offset into the batch for fairness. */
+	struct epoll_event *events;
+	int batch_size, batch_limit;
+	unsigned int rotation;
+	int dispatch_depth;
+
+	struct wl_signal destroy_signal;
 };
 
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+source_account(struct wl_event_source *source, uint64_t start)
+{
+	uint64_t elapsed = monotonic_ns() - start;
+
+	source->dispatch_count++;
+	source->dispatch_ns += elapsed;
+	if (elapsed > source->dispatch_max_ns)
+		source->dispatch_max_ns = elapsed;
+}
+
+static int
+dispatch_source(struct wl_event_source *source, struct epoll_event *ep)
+{
+	uint64_t start;
+	int ret;
+
+	if (!source->loop->profiling)
+		return source->interface->dispatch(source, ep);
+
+	start = monotonic_ns();
+	ret = source->interface->dispatch(source, ep);
+	source_account(source, start);
+
+	return ret;
+}
+
+static void
+source_init(struct wl_event_source *source)
+{
+	source->dispatch_count = 0;
+	source->dispatch_ns = 0;
+	source->dispatch_max_ns = 0;
+	wl_list_init(&source->deferred_link);
+	source->deferred_events = 0;
+	source->suspended = 0;
+}
+
 struct wl_event_source_fd {
 	struct wl_event_source base;
 	wl_event_loop_fd_func_t func;
@@ -92,6 +216,15 @@ struct wl_event_source_interface fd_source_interface = {
 	wl_event_source_fd_dispatch,
 };
 
+static int
+source_epoll_fd(struct wl_event_source *source)
+{
+	if (source->priority == WL_EVENT_PRIORITY_HIGH)
+		return source->loop->high_source.fd;
+
+	return source->loop->epoll_fd;
+}
+
 static struct wl_event_source *
 add_source(struct wl_event_loop *loop,
 	   struct wl_event_source *source, uint32_t mask, void *data)
@@ -105,6 +238,8 @@ add_source(struct wl_event_loop *loop,
 
 	source->loop = loop;
 	source->data = data;
+	source->priority = WL_EVENT_PRIORITY_NORMAL;
+	source_init(source);
 	wl_list_init(&source->link);
 
 	memset(&ep, 0, sizeof ep);
@@ -112,7 +247,10 @@ add_source(struct wl_event_loop *loop,
 		ep.events |= EPOLLIN;
 	if (mask & WL_EVENT_WRITABLE)
 		ep.events |= EPOLLOUT;
+	if (mask & WL_EVENT_EDGE_TRIGGERED)
+		ep.events |= EPOLLET;
 	ep.data.ptr = source;
+	source->events = ep.events;
 
 	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &ep) < 0) {
 		close(source->fd);
@@ -146,7 +284,6 @@ wl_event_loop_add_fd(struct wl_event_loop *loop,
 WL_EXPORT int
 wl_event_source_fd_update(struct wl_event_source *source, uint32_t mask)
 {
-	struct wl_event_loop *loop = source->loop;
 	struct epoll_event ep;
 
 	memset(&ep, 0, sizeof ep);
@@ -154,23 +291,174 @@ wl_event_source_fd_update(struct wl_event_source *source, uint32_t mask)
 		ep.events |= EPOLLIN;
 	if (mask & WL_EVENT_WRITABLE)
 		ep.events |= EPOLLOUT;
+	if (mask & WL_EVENT_EDGE_TRIGGERED)
+		ep.events |= EPOLLET;
+	ep.data.ptr = source;
+	source->events = ep.events;
+
+	/* Picked up when the source is resumed */
+	if (source->suspended)
+		return 0;
+
+	return epoll_ctl(source_epoll_fd(source), EPOLL_CTL_MOD,
+			 source->fd, &ep);
+}
+
+/* Move a source's fd to the epoll set of the given priority */
+static int
+move_source(struct wl_event_source *source, int priority)
+{
+	struct epoll_event ep;
+	int from;
+
+	if (source->priority == priority)
+		return 0;
+
+	from = source_epoll_fd(source);
+	source->priority = priority;
+
+	/* Picked up when the fd is created or the source is resumed */
+	if (source->fd < 0 || source->suspended)
+		return 0;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = source->events;
 	ep.data.ptr = source;
+	if (epoll_ctl(source_epoll_fd(source), EPOLL_CTL_ADD,
+		      source->fd, &ep) < 0) {
+		source->priority = !priority;
+		return -1;
+	}
 
-	return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &ep);
+	epoll_ctl(from, EPOLL_CTL_DEL, source->fd, NULL);
+
+	return 0;
 }
 
 struct wl_event_source_timer {
 	struct wl_event_source base;
 	wl_event_loop_timer_func_t func;
+	struct timespec deadline;
+	int heap_idx;
+	struct wl_list expired;
 };
 
 static int
-wl_event_source_timer_dispatch(struct wl_event_source *source,
-			       struct epoll_event *ep)
+timespec_before(const struct timespec *a, const struct timespec *b)
 {
-	struct wl_event_source_timer *timer_source =
-		(struct wl_event_source_timer *) source;
-	uint64_t expires;
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+
+	return a->tv_nsec < b->tv_nsec;
+}
+
+static void
+timer_heap_set(struct wl_timer_heap *timers, int i,
+	       struct wl_event_source_timer *timer)
+{
+	timers->data[i] = timer;
+	timer->heap_idx = i;
+}
+
+static void
+timer_heap_sift_up(struct wl_timer_heap *timers, int i)
+{
+	struct wl_event_source_timer *timer = timers->data[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!timespec_before(&timer->deadline,
+				     &timers->data[parent]->deadline))
+			break;
+		timer_heap_set(timers, i, timers->data[parent]);
+		i = parent;
+	}
+
+	timer_heap_set(timers, i, timer);
+}
+
+static void
+timer_heap_sift_down(struct wl_timer_heap *timers, int i)
+{
+	struct wl_event_source_timer *timer = timers->data[i];
+	int child;
+
+	while ((child = 2 * i + 1) < timers->count) {
+		if (child + 1 < timers->count &&
+		    timespec_before(&timers->data[child + 1]->deadline,
+				    &timers->data[child]->deadline))
+			child++;
+		if (!timespec_before(&timers->data[child]->deadline,
+				     &timer->deadline))
+			break;
+		timer_heap_set(timers, i, timers->data[child]);
+		i = child;
+	}
+
+	timer_heap_set(timers, i, timer);
+}
+
+static int
+timer_heap_arm(struct wl_timer_heap *timers)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	if (timers->count > 0)
+		its.it_value = timers->data[0]->deadline;
+
+	return timerfd_settime(timers->base.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int
+timer_heap_insert(struct wl_timer_heap *timers,
+		  struct wl_event_source_timer *timer)
+{
+	struct wl_event_source_timer **data;
+	int space;
+
+	if (timers->count == timers->space) {
+		space = timers->space ? timers->space * 2 : 16;
+		data = realloc(timers->data, space * sizeof *data);
+		if (data == NULL)
+			return -1;
+		timers->data = data;
+		timers->space = space;
+	}
+
+	timer_heap_set(timers, timers->count++, timer);
+	timer_heap_sift_up(timers, timer->heap_idx);
+
+	return 0;
+}
+
+static void
+timer_heap_remove(struct wl_timer_heap *timers,
+		  struct wl_event_source_timer *timer)
+{
+	struct wl_event_source_timer *last;
+	int i = timer->heap_idx;
+
+	timer->heap_idx = -1;
+	last = timers->data[--timers->count];
+	if (last == timer)
+		return;
+
+	timer_heap_set(timers, i, last);
+	timer_heap_sift_up(timers, i);
+	timer_heap_sift_down(timers, last->heap_idx);
+}
+
+static int
+timer_heap_dispatch(struct wl_event_source *source,
+		    struct epoll_event *ep)
+{
+	struct wl_timer_heap *timers = (struct wl_timer_heap *) source;
+	struct wl_event_source_timer *timer;
+	struct wl_list expired;
+	struct timespec now;
+	uint64_t expires, start;
 	int len;
 
 	len = read(source->fd, &expires, sizeof expires);
@@ -178,6 +466,49 @@ wl_event_source_timer_dispatch(struct wl_event_source *source,
 		/* Is there anything we can do here?  Will this ever happen? */
 		wl_log("timerfd read error: %m\n");
 
+	/* Collect everything that expired before running any callback,
+	 * so a callback re-arming another expired timer does not keep
+	 * it from firing in this round. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wl_list_init(&expired);
+	while (timers->count > 0 &&
+	       !timespec_before(&now, &timers->data[0]->deadline)) {
+		timer = timers->data[0];
+		timer_heap_remove(timers, timer);
+		wl_list_insert(expired.prev, &timer->expired);
+	}
+
+	if (timer_heap_arm(timers) < 0)
+		wl_log("timerfd_settime failed: %m\n");
+
+	while (!wl_list_empty(&expired)) {
+		timer = container_of(expired.next,
+				     struct wl_event_source_timer, expired);
+		wl_list_remove(&timer->expired);
+		wl_list_init(&timer->expired);
+		if (source->loop->profiling) {
+			start = monotonic_ns();
+			timer->func(timer->base.data);
+			source_account(&timer->base, start);
+		} else {
+			timer->func(timer->base.data);
+		}
+	}
+
+	return 0;
+}
+
+struct wl_event_source_interface timer_heap_interface = {
+	timer_heap_dispatch,
+};
+
+static int
+wl_event_source_timer_dispatch(struct wl_event_source *source,
+			       struct epoll_event *ep)
+{
+	struct wl_event_source_timer *timer_source =
+		(struct wl_event_source_timer *) source;
+
 	return timer_source->func(timer_source->base.data);
 }
 
@@ -191,38 +522,87 @@ wl_event_loop_add_timer(struct wl_event_loop *loop,
 			void *data)
 {
 	struct wl_event_source_timer *source;
+	struct wl_timer_heap *timers = &loop->timers;
+	struct epoll_event ep;
+	int fd;
+
+	if (timers->base.fd < 0) {
+		fd = timerfd_create(CLOCK_MONOTONIC,
+				    TFD_CLOEXEC | TFD_NONBLOCK);
+		if (fd < 0)
+			return NULL;
+
+		/* Timers drive things like key repeat and animations,
+		 * so they run ahead of client traffic. */
+		memset(&ep, 0, sizeof ep);
+		ep.events = EPOLLIN;
+		ep.data.ptr = &timers->base;
+		if (epoll_ctl(loop->high_source.fd, EPOLL_CTL_ADD, fd, &ep) < 0) {
+			close(fd);
+			return NULL;
+		}
+
+		timers->base.fd = fd;
+	}
 
 	source = malloc(sizeof *source);
 	if (source == NULL)
 		return NULL;
 
 	source->base.interface = &timer_source_interface;
-	source->base.fd = timerfd_create(CLOCK_MONOTONIC,
-					 TFD_CLOEXEC | TFD_NONBLOCK);
+	source->base.loop = loop;
+	source->base.fd = -1;
+	source->base.data = data;
+	source_init(&source->base);
+	wl_list_init(&source->base.link);
 	source->func = func;
+	source->heap_idx = -1;
+	wl_list_init(&source->expired);
 
-	return add_source(loop, &source->base, WL_EVENT_READABLE, data);
+	return &source->base;
 }
 
 WL_EXPORT int
 wl_event_source_timer_update(struct wl_event_source *source, int ms_delay)
 {
-	struct itimerspec its;
+	struct wl_event_source_timer *timer =
+		(struct wl_event_source_timer *) source;
+	struct wl_timer_heap *timers = &source->loop->timers;
+	struct wl_event_source_timer *first;
+	int ret = 0;
 
-	its.it_interval.tv_sec = 0;
-	its.it_interval.tv_nsec = 0;
-	its.it_value.tv_sec = ms_delay / 1000;
-	its.it_value.tv_nsec = (ms_delay % 1000) * 1000 * 1000;
-	if (timerfd_settime(source->fd, 0, &its, NULL) < 0)
-		return -1;
+	first = timers->count > 0 ? timers->data[0] : NULL;
 
-	return 0;
+	if (timer->heap_idx >= 0)
+		timer_heap_remove(timers, timer);
+
+	if (ms_delay > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &timer->deadline);
+		timer->deadline.tv_sec += ms_delay / 1000;
+		timer->deadline.tv_nsec += (ms_delay % 1000) * 1000 * 1000;
+		if (timer->deadline.tv_nsec >= 1000 * 1000 * 1000) {
+			timer->deadline.tv_sec++;
+			timer->deadline.tv_nsec -= 1000 * 1000 * 1000;
+		}
+
+		ret = timer_heap_insert(timers, timer);
+	}
+
+	/* Only the earliest deadline is programmed into the timerfd. */
+	if (timer == first ||
+	    (timers->count > 0 && timers->data[0] == timer))
+		if (timer_heap_arm(timers) < 0)
+			ret = -1;
+
+	return ret;
 }
 
 struct wl_event_source_signal {
 	struct wl_event_source base;
 	int signal_number;
 	wl_event_loop_signal_func_t func;
+	struct wl_list signal_link;
+	uint32_t serial;
 };
 
 static int
@@ -231,13 +611,6 @@ wl_event_source_signal_dispatch(struct wl_event_source *source,
 {
 	struct wl_event_source_signal *signal_source =
 		(struct wl_event_source_signal *) source;
-	struct signalfd_siginfo signal_info;
-	int len;
-
-	len = read(source->fd, &signal_info, sizeof signal_info);
-	if (!(len == -1 && errno == EAGAIN) && len != sizeof signal_info)
-		/* Is there anything we can do here?  Will this ever happen? */
-		wl_log("signalfd read error: %m\n");
 
 	return signal_source->func(signal_source->signal_number,
 				   signal_source->base.data);
@@ -247,6 +620,99 @@ struct wl_event_source_interface signal_source_interface = {
 	wl_event_source_signal_dispatch,
 };
 
+static void
+deliver_signal(struct wl_event_loop *loop, int signal_number)
+{
+	struct wl_event_source_signal *source;
+	uint32_t serial = ++loop->signal_serial;
+
+	/* Callbacks may add or remove signal sources, so start over
+	 * after each one; the serial keeps sources from running twice. */
+restart:
+	wl_list_for_each(source, &loop->signal_list, signal_link) {
+		if (source->signal_number == signal_number &&
+		    source->serial != serial) {
+			source->serial = serial;
+			dispatch_source(&source->base, NULL);
+			goto restart;
+		}
+	}
+}
+
+static int
+signal_fd_dispatch(struct wl_event_source *source, struct epoll_event *ep)
+{
+	struct signalfd_siginfo info[16];
+	int i, len;
+
+	/* Drain everything queued on the shared signalfd. */
+	do {
+		len = read(source->fd, info, sizeof info);
+		if (len < 0) {
+			if (errno != EAGAIN)
+				/* Is there anything we can do here?  Will
+				 * this ever happen? */
+				wl_log("signalfd read error: %m\n");
+			break;
+		}
+
+		for (i = 0; i < len / (int) sizeof info[0]; i++)
+			deliver_signal(source->loop, info[i].ssi_signo);
+	} while (len == sizeof info);
+
+	return 0;
+}
+
+struct wl_event_source_interface signal_fd_interface = {
+	signal_fd_dispatch,
+};
+
+static int
+update_signal_priority(struct wl_event_loop *loop)
+{
+	struct wl_event_source_signal *source;
+	int priority = WL_EVENT_PRIORITY_NORMAL;
+
+	wl_list_for_each(source, &loop->signal_list, signal_link)
+		if (source->base.priority == WL_EVENT_PRIORITY_HIGH)
+			priority = WL_EVENT_PRIORITY_HIGH;
+
+	return move_source(&loop->signal_source, priority);
+}
+
+static int
+update_signal_fd(struct wl_event_loop *loop)
+{
+	struct wl_event_source_signal *source;
+	struct epoll_event ep;
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	wl_list_for_each(source, &loop->signal_list, signal_link)
+		sigaddset(&mask, source->signal_number);
+
+	fd = signalfd(loop->signal_source.fd, &mask,
+		      SFD_CLOEXEC | SFD_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	if (loop->signal_source.fd < 0) {
+		memset(&ep, 0, sizeof ep);
+		ep.events = EPOLLIN;
+		ep.data.ptr = &loop->signal_source;
+		if (epoll_ctl(source_epoll_fd(&loop->signal_source),
+			      EPOLL_CTL_ADD, fd, &ep) < 0) {
+			close(fd);
+			return -1;
+		}
+		loop->signal_source.fd = fd;
+		loop->signal_source.events = ep.events;
+	}
+
+	return 0;
+}
+
 WL_EXPORT struct wl_event_source *
 wl_event_loop_add_signal(struct wl_event_loop *loop,
 			int signal_number,
@@ -261,16 +727,61 @@ wl_event_loop_add_signal(struct wl_event_loop *loop,
 		return NULL;
 
 	source->base.interface = &signal_source_interface;
+	source->base.loop = loop;
+	source->base.fd = -1;
+	source->base.data = data;
+	source->base.priority = WL_EVENT_PRIORITY_NORMAL;
+	source_init(&source->base);
+	wl_list_init(&source->base.link);
 	source->signal_number = signal_number;
+	source->func = func;
+	source->serial = loop->signal_serial;
+
+	/* All signal sources share one signalfd; only its mask changes. */
+	wl_list_insert(loop->signal_list.prev, &source->signal_link);
+	if (update_signal_fd(loop) < 0) {
+		wl_list_remove(&source->signal_link);
+		free(source);
+		return NULL;
+	}
 
 	sigemptyset(&mask);
 	sigaddset(&mask, signal_number);
-	source->base.fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
 	sigprocmask(SIG_BLOCK, &mask, NULL);
 
-	source->func = func;
+	return &source->base;
+}
 
-	return add_source(loop, &source->base, WL_EVENT_READABLE, data);
+/* Sources in the high priority class are dispatched before any normal
+ * source that is ready in the same iteration.  Signal sources share one
+ * signalfd, which is high priority while any of them is. */
+WL_EXPORT int
+wl_event_source_set_priority(struct wl_event_source *source, int priority)
+{
+	struct wl_event_loop *loop = source->loop;
+	int old = source->priority;
+
+	if (priority != WL_EVENT_PRIORITY_NORMAL &&
+	    priority != WL_EVENT_PRIORITY_HIGH) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (source->interface == &signal_source_interface) {
+		source->priority = priority;
+		if (update_signal_priority(loop) < 0) {
+			source->priority = old;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (source->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return move_source(source, priority);
 }
 
 struct wl_event_source_idle {
@@ -296,6 +807,7 @@ wl_event_loop_add_idle(struct wl_event_loop *loop,
 	source->base.interface = &idle_source_interface;
 	source->base.loop = loop;
 	source->base.fd = -1;
+	source_init(&source->base);
 
 	source->func = func;
 	source->base.data = data;
@@ -305,6 +817,159 @@ wl_event_loop_add_idle(struct wl_event_loop *loop,
 	return &source->base;
 }
 
+static void
+run_posted_tasks(struct wl_event_loop *loop)
+{
+	struct wl_event_loop_task *task, *next, *tasks = NULL;
+
+	task = __atomic_exchange_n(&loop->posted, NULL, __ATOMIC_ACQUIRE);
+
+	/* The stack holds the newest task first; run them in the order
+	 * they were posted. */
+	while (task) {
+		next = task->next;
+		task->next = tasks;
+		tasks = task;
+		task = next;
+	}
+
+	for (task = tasks; task; task = next) {
+		next = task->next;
+		task->func(task->data);
+		free(task);
+	}
+}
+
+static int
+post_source_dispatch(struct wl_event_source *source,
+		     struct epoll_event *ep)
+{
+	uint64_t count;
+	int len;
+
+	len = read(source->fd, &count, sizeof count);
+	if (!(len == -1 && errno == EAGAIN) && len != sizeof count)
+		wl_log("eventfd read error: %m\n");
+
+	run_posted_tasks(source->loop);
+
+	return 0;
+}
+
+struct wl_event_source_interface post_source_interface = {
+	post_source_dispatch,
+};
+
+/* Safe to call from any thread: the task is pushed onto a lock-free
+ * stack and the loop's eventfd is only written when the stack was
+ * empty, so a burst of posts costs a single wakeup. */
+WL_EXPORT int
+wl_event_loop_post(struct wl_event_loop *loop,
+		   wl_event_loop_task_func_t func, void *data)
+{
+	struct wl_event_loop_task *task, *head;
+	uint64_t one = 1;
+
+	task = malloc(sizeof *task);
+	if (task == NULL)
+		return -1;
+
+	task->func = func;
+	task->data = data;
+
+	head = __atomic_load_n(&loop->posted, __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while (!__atomic_compare_exchange_n(&loop->posted, &head, task, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	if (head == NULL &&
+	    write(loop->post_source.fd, &one, sizeof one) < 0 &&
+	    errno != EAGAIN)
+		return -1;
+
+	return 0;
+}
+
+struct wl_event_loop_sync_task {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+	wl_event_loop_task_func_t func;
+	void *data;
+};
+
+static void
+sync_task_run(void *data)
+{
+	struct wl_event_loop_sync_task *task = data;
+
+	task->func(task->data);
+
+	pthread_mutex_lock(&task->mutex);
+	task->done = 1;
+	pthread_cond_signal(&task->cond);
+	pthread_mutex_unlock(&task->mutex);
+}
+
+/* Run func on the thread dispatching loop and wait for it to finish.
+ * Must not be called from that thread, it would wait forever. */
+WL_EXPORT int
+wl_event_loop_run_sync(struct wl_event_loop *loop,
+		       wl_event_loop_task_func_t func, void *data)
+{
+	struct wl_event_loop_sync_task task;
+	int ret;
+
+	pthread_mutex_init(&task.mutex, NULL);
+	pthread_cond_init(&task.cond, NULL);
+	task.done = 0;
+	task.func = func;
+	task.data = data;
+
+	ret = wl_event_loop_post(loop, sync_task_run, &task);
+	if (ret == 0) {
+		pthread_mutex_lock(&task.mutex);
+		while (!task.done)
+			pthread_cond_wait(&task.cond, &task.mutex);
+		pthread_mutex_unlock(&task.mutex);
+	}
+
+	pthread_cond_destroy(&task.cond);
+	pthread_mutex_destroy(&task.mutex);
+
+	return ret;
+}
+
+WL_EXPORT void
+wl_idle_task_init(struct wl_idle_task *task, wl_idle_task_func_t func)
+{
+	wl_list_init(&task->link);
+	task->func = func;
+}
+
+WL_EXPORT void
+wl_event_loop_schedule_idle_task(struct wl_event_loop *loop,
+				 struct wl_idle_task *task)
+{
+	if (wl_list_empty(&task->link))
+		wl_list_insert(loop->idle_task_list.prev, &task->link);
+}
+
+WL_EXPORT void
+wl_idle_task_cancel(struct wl_idle_task *task)
+{
+	wl_list_remove(&task->link);
+	wl_list_init(&task->link);
+}
+
+WL_EXPORT int
+wl_idle_task_is_scheduled(struct wl_idle_task *task)
+{
+	return !wl_list_empty(&task->link);
+}
+
 WL_EXPORT void
 wl_event_source_check(struct wl_event_source *source)
 {
@@ -316,10 +981,34 @@ wl_event_source_remove(struct wl_event_source *source)
 {
 	struct wl_event_loop *loop = source->loop;
 
+	if (source->interface == &signal_source_interface) {
+		struct wl_event_source_signal *signal_source =
+			(struct wl_event_source_signal *) source;
+
+		wl_list_remove(&signal_source->signal_link);
+		update_signal_fd(loop);
+		update_signal_priority(loop);
+	}
+
+	if (source->interface == &timer_source_interface) {
+		struct wl_event_source_timer *timer =
+			(struct wl_event_source_timer *) source;
+
+		if (timer->heap_idx >= 0)
+			timer_heap_remove(&loop->timers, timer);
+		wl_list_remove(&timer->expired);
+		wl_list_init(&timer->expired);
+	}
+
+	wl_list_remove(&source->deferred_link);
+	wl_list_init(&source->deferred_link);
+
 	/* We need to explicitly remove the fd, since closing the fd
 	 * isn't enough in case we've dup'ed the fd. */
 	if (source->fd >= 0) {
-		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+		if (!source->suspended)
+			epoll_ctl(source_epoll_fd(source), EPOLL_CTL_DEL,
+				  source->fd, NULL);
 		close(source->fd);
 		source->fd = -1;
 	}
@@ -341,10 +1030,251 @@ wl_event_loop_process_destroy_list(struct wl_event_loop *loop)
 	wl_list_init(&loop->destroy_list);
 }
 
+static int
+wait_events(struct wl_event_loop *loop,
+	    struct epoll_event *ep, int max, int timeout)
+{
+	uint64_t start, now, budget;
+	int count;
+
+	if (loop->busy_poll_ns == 0)
+		return epoll_wait(loop->epoll_fd, ep, max, timeout);
+
+	start = now = monotonic_ns();
+
+	if (loop->busy_poll_armed && timeout != 0) {
+		budget = loop->busy_poll_ns;
+		if (timeout > 0 && budget > timeout * 1000000ULL)
+			budget = timeout * 1000000ULL;
+
+		do {
+			count = epoll_wait(loop->epoll_fd, ep, max, 0);
+			now = monotonic_ns();
+		} while (count == 0 && now - start < budget);
+
+		loop->spin_ns += now - start;
+		if (count != 0)
+			return count;
+
+		/* Went quiet: stop spinning until there is activity. */
+		loop->busy_poll_armed = 0;
+		if (timeout > 0) {
+			timeout -= (now - start) / 1000000;
+			if (timeout < 0)
+				timeout = 0;
+		}
+	}
+
+	count = epoll_wait(loop->epoll_fd, ep, max, timeout);
+	loop->sleep_ns += monotonic_ns() - now;
+
+	return count;
+}
+
+/* A budget of 0 disables busy polling. */
+WL_EXPORT void
+wl_event_loop_set_busy_poll(struct wl_event_loop *loop, uint32_t budget_us)
+{
+	loop->busy_poll_ns = (uint64_t) budget_us * 1000;
+	loop->busy_poll_armed = 0;
+}
+
+/* Time spent spinning and blocked waiting for events while busy
+ * polling was enabled, in nanoseconds. */
+WL_EXPORT void
+wl_event_loop_get_busy_poll_stats(struct wl_event_loop *loop,
+				  uint64_t *spin_ns, uint64_t *sleep_ns)
+{
+	if (spin_ns)
+		*spin_ns = loop->spin_ns;
+	if (sleep_ns)
+		*sleep_ns = loop->sleep_ns;
+}
+
+/* Accounting costs two clock reads per dispatched source, which is
+ * why it is off by default. */
+WL_EXPORT void
+wl_event_loop_set_profiling(struct wl_event_loop *loop, int enabled)
+{
+	loop->profiling = enabled;
+}
+
+/* Time spent blocked waiting for events and running idle work while
+ * profiling was enabled, in nanoseconds. */
+WL_EXPORT void
+wl_event_loop_get_dispatch_stats(struct wl_event_loop *loop,
+				 uint64_t *wait_ns, uint64_t *idle_ns)
+{
+	if (wait_ns)
+		*wait_ns = loop->wait_ns;
+	if (idle_ns)
+		*idle_ns = loop->idle_ns;
+}
+
+/* How often the source was dispatched while profiling was enabled, and
+ * the total and longest time its callback took, in nanoseconds. */
+WL_EXPORT void
+wl_event_source_get_dispatch_stats(struct wl_event_source *source,
+				   uint64_t *count,
+				   uint64_t *total_ns, uint64_t *max_ns)
+{
+	if (count)
+		*count = source->dispatch_count;
+	if (total_ns)
+		*total_ns = source->dispatch_ns;
+	if (max_ns)
+		*max_ns = source->dispatch_max_ns;
+}
+
+/* Tell the loop when the next repaint is due.  Once fewer than
+ * margin_us remain before deadline, wl_event_loop_dispatch() stops
+ * dispatching normal priority sources and client request backlogs, and
+ * picks them up again, in order, once a later deadline is set or the
+ * deadline is cleared by passing NULL.  Held back level-triggered
+ * fds are taken out of epoll meanwhile, so they don't wake up the loop.
+ * High priority sources and tasks from wl_event_loop_post() keep being
+ * dispatched, so the repaint itself should be driven by one. */
+WL_EXPORT void
+wl_event_loop_set_deadline(struct wl_event_loop *loop,
+			   const struct timespec *deadline,
+			   uint32_t margin_us)
+{
+	if (deadline == NULL) {
+		loop->has_deadline = 0;
+		return;
+	}
+
+	loop->has_deadline = 1;
+	loop->deadline_ns = (uint64_t) deadline->tv_sec * 1000000000 +
+		deadline->tv_nsec - (uint64_t) margin_us * 1000;
+}
+
+WL_EXPORT int
+wl_event_loop_deadline_reached(struct wl_event_loop *loop)
+{
+	return loop->has_deadline && monotonic_ns() >= loop->deadline_ns;
+}
+
+static void
+suspend_source(struct wl_event_source *source)
+{
+	/* An edge-triggered fd doesn't report the same readiness again,
+	 * so it can stay in epoll. */
+	if (source->fd < 0 || source->suspended ||
+	    (source->events & EPOLLET))
+		return;
+
+	if (epoll_ctl(source_epoll_fd(source), EPOLL_CTL_DEL,
+		      source->fd, NULL) == 0)
+		source->suspended = 1;
+}
+
+static void
+resume_source(struct wl_event_source *source)
+{
+	struct epoll_event ep;
+
+	if (!source->suspended)
+		return;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = source->events;
+	ep.data.ptr = source;
+	if (epoll_ctl(source_epoll_fd(source), EPOLL_CTL_ADD,
+		      source->fd, &ep) < 0)
+		wl_log("failed to resume event source: %m\n");
+
+	source->suspended = 0;
+}
+
+static void
+defer_events(struct wl_event_source *source, uint32_t events)
+{
+	source->deferred_events |= events;
+	if (wl_list_empty(&source->deferred_link))
+		wl_list_insert(source->loop->deferred_list.prev,
+			       &source->deferred_link);
+
+	if (wl_event_loop_deadline_reached(source->loop))
+		suspend_source(source);
+}
+
+void
+wl_event_source_defer(struct wl_event_source *source, uint32_t mask)
+{
+	uint32_t events = 0;
+
+	if (mask & WL_EVENT_READABLE)
+		events |= EPOLLIN;
+	if (mask & WL_EVENT_WRITABLE)
+		events |= EPOLLOUT;
+
+	defer_events(source, events);
+}
+
+static void
+dispatch_deferred(struct wl_event_loop *loop)
+{
+	struct wl_event_source *source;
+	struct epoll_event ep;
+	struct wl_list pending;
+
+	wl_list_init(&pending);
+	wl_list_insert_list(&pending, &loop->deferred_list);
+	wl_list_init(&loop->deferred_list);
+
+	while (!wl_list_empty(&pending)) {
+		if (wl_event_loop_deadline_reached(loop)) {
+			/* Keep the older work ahead of anything deferred
+			 * while this batch ran. */
+			wl_list_insert_list(&loop->deferred_list, &pending);
+			wl_list_for_each(source, &loop->deferred_list,
+					 deferred_link)
+				suspend_source(source);
+			break;
+		}
+
+		source = container_of(pending.next,
+				      struct wl_event_source, deferred_link);
+		wl_list_remove(&source->deferred_link);
+		wl_list_init(&source->deferred_link);
+		resume_source(source);
+
+		memset(&ep, 0, sizeof ep);
+		ep.events = source->deferred_events;
+		ep.data.ptr = source;
+		source->deferred_events = 0;
+		dispatch_source(source, &ep);
+	}
+}
+
+static int
+high_source_dispatch(struct wl_event_source *source,
+		     struct epoll_event *ep)
+{
+	struct epoll_event events[32];
+	struct wl_event_source *high;
+	int i, count;
+
+	count = epoll_wait(source->fd, events, ARRAY_LENGTH(events), 0);
+	for (i = 0; i < count; i++) {
+		high = events[i].data.ptr;
+		if (high->fd != -1)
+			dispatch_source(high, &events[i]);
+	}
+
+	return 0;
+}
+
+struct wl_event_source_interface high_source_interface = {
+	high_source_dispatch,
+};
+
 WL_EXPORT struct wl_event_loop *
 wl_event_loop_create(void)
 {
 	struct wl_event_loop *loop;
+	struct epoll_event ep;
 
 	loop = malloc(sizeof *loop);
 	if (loop == NULL)
@@ -357,19 +1287,106 @@ wl_event_loop_create(void)
 	}
 	wl_list_init(&loop->check_list);
 	wl_list_init(&loop->idle_list);
+	wl_list_init(&loop->idle_task_list);
 	wl_list_init(&loop->destroy_list);
+	wl_list_init(&loop->deferred_list);
+	loop->has_deadline = 0;
+	loop->events = NULL;
+	loop->batch_size = EVENT_BATCH_MIN;
+	loop->batch_limit = EVENT_BATCH_LIMIT;
+	loop->rotation = 0;
+	loop->dispatch_depth = 0;
+
+	memset(&loop->timers, 0, sizeof loop->timers);
+	source_init(&loop->timers.base);
+	loop->timers.base.interface = &timer_heap_interface;
+	loop->timers.base.fd = -1;
+	loop->timers.base.loop = loop;
+	loop->timers.base.priority = WL_EVENT_PRIORITY_HIGH;
+
+	loop->signal_source.interface = &signal_fd_interface;
+	loop->signal_source.loop = loop;
+	loop->signal_source.fd = -1;
+	loop->signal_source.priority = WL_EVENT_PRIORITY_NORMAL;
+	source_init(&loop->signal_source);
+	wl_list_init(&loop->signal_list);
+	loop->signal_serial = 0;
+
+	loop->high_source.interface = &high_source_interface;
+	loop->high_source.loop = loop;
+	source_init(&loop->high_source);
+	loop->high_source.fd = wl_os_epoll_create_cloexec();
+	if (loop->high_source.fd < 0)
+		goto err_epoll;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = &loop->high_source;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD,
+		      loop->high_source.fd, &ep) < 0)
+		goto err_high;
+
+	loop->posted = NULL;
+	loop->busy_poll_ns = 0;
+	loop->busy_poll_armed = 0;
+	loop->spin_ns = 0;
+	loop->sleep_ns = 0;
+	loop->profiling = 0;
+	loop->wait_ns = 0;
+	loop->idle_ns = 0;
+	loop->post_source.interface = &post_source_interface;
+	loop->post_source.loop = loop;
+	source_init(&loop->post_source);
+	loop->post_source.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (loop->post_source.fd < 0)
+		goto err_high;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = &loop->post_source;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD,
+		      loop->post_source.fd, &ep) < 0)
+		goto err_post;
 
 	wl_signal_init(&loop->destroy_signal);
 
 	return loop;
+
+err_post:
+	close(loop->post_source.fd);
+err_high:
+	close(loop->high_source.fd);
+err_epoll:
+	close(loop->epoll_fd);
+	free(loop);
+	return NULL;
 }
 
 WL_EXPORT void
 wl_event_loop_destroy(struct wl_event_loop *loop)
 {
+	/* Tasks may own their data, so run what is still queued rather
+	 * than dropping it. */
+	run_posted_tasks(loop);
+
 	wl_signal_emit(&loop->destroy_signal, loop);
 
+	/* Leave tasks that never ran in a state they can be cancelled
+	 * or rescheduled from. */
+	while (!wl_list_empty(&loop->idle_task_list))
+		wl_idle_task_cancel(container_of(loop->idle_task_list.next,
+						 struct wl_idle_task, link));
+
+	close(loop->post_source.fd);
+	close(loop->high_source.fd);
+
 	wl_event_loop_process_destroy_list(loop);
+	if (loop->timers.base.fd >= 0)
+		close(loop->timers.base.fd);
+	if (loop->signal_source.fd >= 0)
+		close(loop->signal_source.fd);
+	free(loop->timers.data);
+	free(loop->events);
 	close(loop->epoll_fd);
 	free(loop);
 }
@@ -384,7 +1401,7 @@ post_dispatch_check(struct wl_event_loop *loop)
 	ep.events = 0;
 	n = 0;
 	wl_list_for_each_safe(source, next, &loop->check_list, link)
-		n += source->interface->dispatch(source, &ep);
+		n += dispatch_source(source, &ep);
 
 	return n;
 }
@@ -393,6 +1410,12 @@ WL_EXPORT void
 wl_event_loop_dispatch_idle(struct wl_event_loop *loop)
 {
 	struct wl_event_source_idle *source;
+	struct wl_idle_task *task;
+	struct wl_list tasks;
+	uint64_t start = 0;
+
+	if (loop->profiling)
+		start = monotonic_ns();
 
 	while (!wl_list_empty(&loop->idle_list)) {
 		source = container_of(loop->idle_list.next,
@@ -400,27 +1423,147 @@ wl_event_loop_dispatch_idle(struct wl_event_loop *loop)
 		source->func(source->base.data);
 		wl_event_source_remove(&source->base);
 	}
+
+	/* Tasks scheduled while these run wait for the next round, so
+	 * a task that reschedules itself cannot starve the loop. */
+	wl_list_init(&tasks);
+	wl_list_insert_list(&tasks, &loop->idle_task_list);
+	wl_list_init(&loop->idle_task_list);
+	while (!wl_list_empty(&tasks)) {
+		task = container_of(tasks.next, struct wl_idle_task, link);
+		wl_idle_task_cancel(task);
+		task->func(task);
+	}
+
+	if (loop->profiling)
+		loop->idle_ns += monotonic_ns() - start;
+}
+
+/* Upper bound for the number of events fetched per epoll_wait().
+ * A limit below the current batch shrinks it right away. */
+WL_EXPORT int
+wl_event_loop_set_batch_limit(struct wl_event_loop *loop, int limit)
+{
+	struct epoll_event *events;
+
+	if (limit <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	loop->batch_limit = limit;
+	if (loop->batch_size <= limit)
+		return 0;
+
+	loop->batch_size = limit < EVENT_BATCH_MIN ? EVENT_BATCH_MIN : limit;
+
+	/* An outer dispatch may still be walking the allocated batch */
+	if (loop->events == NULL || loop->dispatch_depth > 0)
+		return 0;
+
+	if (loop->batch_size == EVENT_BATCH_MIN) {
+		free(loop->events);
+		loop->events = NULL;
+		return 0;
+	}
+
+	events = realloc(loop->events,
+			 loop->batch_size * sizeof *events);
+	if (events)
+		loop->events = events;
+
+	return 0;
+}
+
+static void
+grow_batch(struct wl_event_loop *loop)
+{
+	struct epoll_event *events;
+	int size = loop->batch_size * 2;
+
+	if (size > loop->batch_limit)
+		size = loop->batch_limit;
+	if (size <= loop->batch_size)
+		return;
+
+	events = realloc(loop->events, size * sizeof *events);
+	if (events == NULL)
+		return;
+
+	loop->events = events;
+	loop->batch_size = size;
 }
 
 WL_EXPORT int
 wl_event_loop_dispatch(struct wl_event_loop *loop, int timeout)
 {
-	struct epoll_event ep[32];
+	struct epoll_event stack_ep[EVENT_BATCH_MIN], *ep = stack_ep;
 	struct wl_event_source *source;
-	int i, count, n;
+	int i, k, first, size, count, n, high;
+	uint64_t start = 0;
+
+	/* A nested dispatch must not reuse the outer batch. */
+	size = ARRAY_LENGTH(stack_ep);
+	if (loop->events && loop->dispatch_depth == 0) {
+		ep = loop->events;
+		size = loop->batch_size;
+	}
+	if (size > loop->batch_limit)
+		size = loop->batch_limit;
 
 	wl_event_loop_dispatch_idle(loop);
 
-	count = epoll_wait(loop->epoll_fd, ep, ARRAY_LENGTH(ep), timeout);
+	/* Deferred work is ready to run as soon as the deadline allows,
+	 * and tasks scheduled by idle work wait for the next round only. */
+	if (!wl_list_empty(&loop->deferred_list) &&
+	    !wl_event_loop_deadline_reached(loop))
+		timeout = 0;
+	if (!wl_list_empty(&loop->idle_task_list))
+		timeout = 0;
+
+	if (loop->profiling)
+		start = monotonic_ns();
+	count = wait_events(loop, ep, size, timeout);
+	if (loop->profiling)
+		loop->wait_ns += monotonic_ns() - start;
 	if (count < 0)
 		return -1;
+	if (count > 0)
+		loop->busy_poll_armed = 1;
 
-	for (i = 0; i < count; i++) {
+	loop->dispatch_depth++;
+
+	/* A full batch may have left the high priority set out, so
+	 * check it anyway in that case. */
+	high = count == size;
+	for (i = 0; i < count; i++)
+		if (ep[i].data.ptr == &loop->high_source)
+			high = 1;
+	if (high)
+		high_source_dispatch(&loop->high_source, NULL);
+
+	dispatch_deferred(loop);
+
+	first = count > 0 ? loop->rotation++ % count : 0;
+	for (k = 0; k < count; k++) {
+		i = (first + k) % count;
 		source = ep[i].data.ptr;
-		if (source->fd != -1)
-			source->interface->dispatch(source, &ep[i]);
+		if (source == &loop->high_source || source->fd == -1)
+			continue;
+
+		/* Posted tasks may have a thread waiting on them, see
+		 * wl_event_loop_run_sync(), so they are never held back. */
+		if (source != &loop->post_source &&
+		    wl_event_loop_deadline_reached(loop))
+			defer_events(source, ep[i].events);
+		else
+			dispatch_source(source, &ep[i]);
 	}
 
+	loop->dispatch_depth--;
+	if (count == size && loop->dispatch_depth == 0)
+		grow_batch(loop);
+
 	wl_event_loop_process_destroy_list(loop);
 
 	wl_event_loop_dispatch_idle(loop);
@@ -105,6 +105,10 @@ struct wl_proxy;
  * might be events queued on the default queue. Those events should be
  * dispatched with \ref wl_display_dispatch_pending() or \ref
  * wl_display_dispatch_queue_pending() before flushing and blocking.
+ *
+ * Alternatively, \ref wl_display_start_read_thread() lets the library read
+ * the display fd from its own thread. Threads then only wait for and
+ * dispatch their queues with \ref wl_display_dispatch_queue().
  */
 struct wl_display;
 
@@ -118,9 +122,28 @@ struct wl_display;
  */
 struct wl_event_queue;
 
+/** \class wl_sync_future
+ *
+ * \brief A wl_display.sync request whose reply has not been waited for.
+ *
+ * Created with \ref wl_display_sync_future(). It completes once the
+ * server has processed all earlier requests and the reply is dispatched,
+ * and can be polled, waited on with a timeout, or given a callback.
+ */
+struct wl_sync_future;
+
+typedef void (*wl_sync_future_func_t)(void *data,
+				      struct wl_sync_future *future);
+
 void
 wl_event_queue_destroy(struct wl_event_queue *queue);
 
+int
+wl_event_queue_get_fd(struct wl_event_queue *queue);
+
+void
+wl_event_queue_set_coalescing(struct wl_event_queue *queue, int enable);
+
 void
 wl_proxy_marshal(struct wl_proxy *p, uint32_t opcode, ...);
 
@@ -165,6 +188,9 @@ wl_proxy_add_listener(struct wl_proxy *proxy,
 const void *
 wl_proxy_get_listener(struct wl_proxy *proxy);
 
+void
+wl_proxy_set_ignore_unhandled_events(struct wl_proxy *proxy, int enable);
+
 int
 wl_proxy_add_dispatcher(struct wl_proxy *proxy,
 			wl_dispatcher_func_t dispatcher_func,
@@ -225,6 +251,64 @@ wl_display_get_protocol_error(struct wl_display *display,
 int
 wl_display_flush(struct wl_display *display);
 
+/**
+ * Flags for wl_display_set_flush_policy()
+ */
+enum wl_display_flush_flags {
+	/** flush once this many bytes are buffered */
+	WL_DISPLAY_FLUSH_BYTES = 0x1,
+	/** flush once this many requests were issued */
+	WL_DISPLAY_FLUSH_MESSAGES = 0x2,
+	/** flush before waiting for events */
+	WL_DISPLAY_FLUSH_BEFORE_READ = 0x4
+};
+
+void
+wl_display_cork(struct wl_display *display);
+
+int
+wl_display_uncork(struct wl_display *display);
+
+void
+wl_display_set_flush_policy(struct wl_display *display, uint32_t flags,
+			    uint32_t max_bytes, uint32_t max_messages);
+
+/**
+ * Counters filled in by wl_display_get_stats()
+ */
+struct wl_display_stats {
+	/** bytes written to and read from the socket */
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	/** requests sent and events received */
+	uint64_t messages_sent;
+	uint64_t messages_received;
+	/** flushes with data to send, and those that hit EAGAIN */
+	uint64_t flushes;
+	uint64_t flushes_eagain;
+	/** nanoseconds spent blocked waiting for events */
+	uint64_t read_wait_ns;
+};
+
+/**
+ * Counters filled in by wl_event_queue_get_stats()
+ */
+struct wl_event_queue_stats {
+	uint64_t events_queued;
+	uint64_t events_dispatched;
+	/** events currently waiting, and the most ever waiting */
+	uint32_t depth;
+	uint32_t max_depth;
+};
+
+void
+wl_display_get_stats(struct wl_display *display,
+		     struct wl_display_stats *stats);
+
+void
+wl_event_queue_get_stats(struct wl_event_queue *queue,
+			 struct wl_event_queue_stats *stats);
+
 int
 wl_display_roundtrip_queue(struct wl_display *display,
 			   struct wl_event_queue *queue);
@@ -235,6 +319,26 @@ wl_display_roundtrip(struct wl_display *display);
 struct wl_event_queue *
 wl_display_create_queue(struct wl_display *display);
 
+struct wl_sync_future *
+wl_display_sync_future(struct wl_display *display,
+		       struct wl_event_queue *queue);
+
+void
+wl_sync_future_set_callback(struct wl_sync_future *future,
+			    wl_sync_future_func_t func, void *data);
+
+int
+wl_sync_future_is_done(struct wl_sync_future *future);
+
+uint32_t
+wl_sync_future_get_serial(struct wl_sync_future *future);
+
+int
+wl_sync_future_wait(struct wl_sync_future *future, int timeout);
+
+void
+wl_sync_future_destroy(struct wl_sync_future *future);
+
 int
 wl_display_prepare_read_queue(struct wl_display *display,
 			      struct wl_event_queue *queue);
@@ -248,6 +352,12 @@ wl_display_cancel_read(struct wl_display *display);
 int
 wl_display_read_events(struct wl_display *display);
 
+int
+wl_display_start_read_thread(struct wl_display *display);
+
+void
+wl_display_stop_read_thread(struct wl_display *display);
+
 void
 wl_log_set_handler_client(wl_log_func_t handler);
 
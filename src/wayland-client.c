@@ -41,6 +41,9 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
 #include "wayland-util.h"
 #include "wayland-os.h"
@@ -63,6 +66,21 @@ struct wl_proxy {
 	void *user_data;
 	wl_dispatcher_func_t dispatcher;
 	uint32_t version;
+
+	/* Opcodes dropped as soon as they are read, see
+	 * wl_proxy_set_ignore_unhandled_events() */
+	int ignore_unhandled;
+	uint64_t ignored_events;
+};
+
+struct wl_sync_future {
+	struct wl_display *display;
+	struct wl_event_queue *queue;
+	struct wl_callback *callback;
+	int done;
+	uint32_t serial;
+	wl_sync_future_func_t func;
+	void *data;
 };
 
 struct wl_global {
@@ -72,9 +90,57 @@ struct wl_global {
 	struct wl_list link;
 };
 
+/* Must be a power of two */
+#define QUEUE_RING_SIZE 64
+
+/* Most events of one input frame held back for coalescing */
+#define COALESCE_FRAME_MAX 16
+
 struct wl_event_queue {
-	struct wl_list event_list;
 	struct wl_display *display;
+
+	/* Events are published by the reading thread, which holds the
+	 * display mutex and so is the only producer, into a bounded ring
+	 * without taking any lock.  When the ring is full, or while
+	 * anything is left on overflow_list, they go to overflow_list
+	 * instead, which keeps the queue in order: the ring is always
+	 * drained before the overflow list. */
+	struct wl_closure *ring[QUEUE_RING_SIZE];
+	uint32_t ring_head;
+	uint32_t ring_tail;
+	struct wl_list overflow_list;
+	uint32_t overflow_count;
+
+	/* Guards overflow_list and serializes threads dispatching this
+	 * queue; the ring itself has a single consumer at a time. */
+	pthread_mutex_t mutex;
+
+	/* Lock-free stack of dispatched closures, linked through
+	 * link.next.  The next reader returns them to the connection's
+	 * closure cache, which is only touched under the display mutex. */
+	struct wl_list *recycled;
+
+	/* wl_display::queue_list, and wl_display::touched_list while a
+	 * read has queued events here; both under the display mutex. */
+	struct wl_list link;
+	struct wl_list touched_link;
+
+	/* Created on demand by wl_event_queue_get_fd(), otherwise -1 */
+	int event_fd;
+
+	/* See wl_event_queue_set_coalescing(); only used by the reader.
+	 * Events of a new input frame are held back on coalesce_pending
+	 * until its frame event arrives, see queue_coalesce(). */
+	int coalesce;
+	struct wl_list coalesce_pending;
+	uint32_t coalesce_pending_count;
+
+	/* See wl_event_queue_get_stats().  Each counter has a single
+	 * writer, the reader or the dispatching thread, and is read
+	 * atomically. */
+	uint64_t events_queued;
+	uint64_t events_dispatched;
+	uint32_t max_depth;
 };
 
 struct wl_display {
@@ -102,35 +168,202 @@ struct wl_display {
 	struct wl_map objects;
 	struct wl_event_queue display_queue;
 	struct wl_event_queue default_queue;
+	struct wl_list queue_list;
+	struct wl_list touched_list;
+
+	/* Guards the connection, the object map, the reader state and
+	 * the error fields.  Queue event lists have their own lock, so
+	 * dispatching a queue does not take this one.  When both are
+	 * needed, this mutex is taken first: never lock the display
+	 * while holding a wl_event_queue mutex. */
 	pthread_mutex_t mutex;
 
 	int reader_count;
-	uint32_t read_serial;
-	pthread_cond_t reader_cond;
+	struct wl_list reader_waiters;
+
+	/* Library-owned reader, see wl_display_start_read_thread() */
+	pthread_t read_thread;
+	int read_thread_running;
+	int read_thread_stop_fd;
+
+	/* Automatic flushing, see wl_display_set_flush_policy() */
+	int cork_count;
+	uint32_t flush_flags;
+	uint32_t flush_bytes;
+	uint32_t flush_messages;
+	uint32_t unflushed_messages;
+
+	/* See wl_display_get_stats(); the wait time is updated atomically,
+	 * as it is also accounted outside the display mutex. */
+	uint64_t messages_sent;
+	uint64_t messages_received;
+	uint64_t read_wait_ns;
+};
+
+enum reader_waiter_state {
+	WAITER_SLEEPING,
+	WAITER_DONE
+};
+
+/* A thread sleeping in read_events(), or waiting for the library reader
+ * thread, on wl_display::reader_waiters.  Each has its own condition so
+ * that a read only wakes the threads whose queue received events. */
+struct reader_waiter {
+	struct wl_list link;
+	struct wl_event_queue *queue;
+	int can_read;
+	enum reader_waiter_state state;
+	pthread_cond_t cond;
 };
 
 /** \endcond */
 
 static int debug_client = 0;
 
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Account time spent waiting for events since start */
+static void
+display_add_read_wait(struct wl_display *display, uint64_t start)
+{
+	__atomic_fetch_add(&display->read_wait_ns, monotonic_ns() - start,
+			   __ATOMIC_RELAXED);
+}
+
+static pthread_once_t prepared_queue_once = PTHREAD_ONCE_INIT;
+static pthread_key_t prepared_queue_key;
+
+static void
+init_prepared_queue_key(void)
+{
+	pthread_key_create(&prepared_queue_key, NULL);
+}
+
+/* Remember which queue the calling thread prepared to read for, so
+ * that read_events() only wakes it up once that queue has events. */
+static void
+set_prepared_queue(struct wl_event_queue *queue)
+{
+	pthread_once(&prepared_queue_once, init_prepared_queue_key);
+	pthread_setspecific(prepared_queue_key, queue);
+}
+
+static struct wl_event_queue *
+take_prepared_queue(struct wl_display *display)
+{
+	struct wl_event_queue *queue;
+
+	pthread_once(&prepared_queue_once, init_prepared_queue_key);
+	queue = pthread_getspecific(prepared_queue_key);
+	pthread_setspecific(prepared_queue_key, NULL);
+
+	if (queue && queue->display != display)
+		return NULL;
+
+	return queue;
+}
+
+/* The caller should hold the display lock */
+static void
+display_wait(struct wl_display *display, struct reader_waiter *waiter)
+{
+	uint64_t start = monotonic_ns();
+
+	pthread_cond_init(&waiter->cond, NULL);
+	waiter->state = WAITER_SLEEPING;
+	wl_list_insert(display->reader_waiters.prev, &waiter->link);
+
+	while (waiter->state == WAITER_SLEEPING)
+		pthread_cond_wait(&waiter->cond, &display->mutex);
+
+	pthread_cond_destroy(&waiter->cond);
+	display_add_read_wait(display, start);
+}
+
+static void
+display_wake_waiter(struct reader_waiter *waiter,
+		    enum reader_waiter_state state)
+{
+	wl_list_remove(&waiter->link);
+	waiter->state = state;
+	pthread_cond_signal(&waiter->cond);
+}
+
 /**
  * This helper function wakes up all threads that are
- * waiting for display->reader_cond (i. e. when reading is done,
- * canceled, or an error occurred)
+ * waiting in read_events() or for the reader thread (i. e. when
+ * a read is canceled, finds no data, or an error occurred)
  *
  * NOTE: must be called with display->mutex locked
  */
 static void
 display_wakeup_threads(struct wl_display *display)
 {
-	/* Thread can get sleeping only in read_events(). If we're
-	 * waking it up, it means that the read completed or was
-	 * canceled, so we must increase the read_serial.
-	 * This prevents from indefinite sleeping in read_events().
-	 */
-	++display->read_serial;
+	struct reader_waiter *waiter, *tmp;
+
+	wl_list_for_each_safe(waiter, tmp, &display->reader_waiters, link)
+		display_wake_waiter(waiter, WAITER_DONE);
+}
+
+static void
+queue_signal(struct wl_event_queue *queue)
+{
+	uint64_t value = 1;
+
+	if (queue->event_fd >= 0 &&
+	    write(queue->event_fd, &value, sizeof value) < 0 &&
+	    errno != EAGAIN)
+		wl_log("failed to signal event queue: %m\n");
+}
+
+/* Called by the thread that just read, with the display lock held.
+ * Wakes the waiters whose queue received events, and the ones that
+ * did not prepare with a queue.  If threads are left sleeping in
+ * read_events() and nobody else is prepared to read, one of them is
+ * woken as well, so that its caller reads again on their behalf. */
+static void
+display_signal_touched_queues(struct wl_display *display)
+{
+	struct wl_event_queue *queue, *tmp;
+	struct reader_waiter *waiter, *next;
+	struct reader_waiter *reader = NULL;
+
+	wl_list_for_each_safe(waiter, next, &display->reader_waiters, link) {
+		if (!waiter->queue ||
+		    !wl_list_empty(&waiter->queue->touched_link))
+			display_wake_waiter(waiter, WAITER_DONE);
+		else if (waiter->can_read && !reader)
+			reader = waiter;
+	}
+
+	if (reader && display->reader_count == 0)
+		display_wake_waiter(reader, WAITER_DONE);
+
+	wl_list_for_each_safe(queue, tmp, &display->touched_list,
+			      touched_link) {
+		wl_list_remove(&queue->touched_link);
+		wl_list_init(&queue->touched_link);
+		queue_signal(queue);
+	}
+}
+
+/* The caller should hold the display lock */
+static void
+display_signal_all_queues(struct wl_display *display)
+{
+	struct wl_event_queue *queue;
 
-	pthread_cond_broadcast(&display->reader_cond);
+	display_signal_touched_queues(display);
+	wl_list_for_each(queue, &display->queue_list, link)
+		queue_signal(queue);
 }
 
 /**
@@ -150,8 +383,9 @@ display_fatal_error(struct wl_display *display, int error)
 	if (!error)
 		error = EFAULT;
 
-	display->last_error = error;
+	__atomic_store_n(&display->last_error, error, __ATOMIC_RELEASE);
 
+	display_signal_all_queues(display);
 	display_wakeup_threads(display);
 }
 
@@ -195,21 +429,17 @@ display_protocol_error(struct wl_display *display, uint32_t code,
 
 	pthread_mutex_lock(&display->mutex);
 
-	display->last_error = err;
-
 	display->protocol_error.code = code;
 	display->protocol_error.id = id;
 	display->protocol_error.interface = intf;
 
-	/*
-	 * here it is not necessary to wake up threads like in
-	 * display_fatal_error, because this function is called from
-	 * an event handler and that means that read_events() is done
-	 * and woke up all threads. Since wl_display_prepare_read()
-	 * fails when there are events in the queue, no threads
-	 * can sleep in read_events() during dispatching
-	 * (and therefore during calling this function), so this is safe.
-	 */
+	__atomic_store_n(&display->last_error, err, __ATOMIC_RELEASE);
+
+	display_signal_all_queues(display);
+
+	/* Threads can be sleeping in read_events() until their own queue
+	 * gets events, or waiting for the library reader thread. */
+	display_wakeup_threads(display);
 
 	pthread_mutex_unlock(&display->mutex);
 }
@@ -217,8 +447,265 @@ display_protocol_error(struct wl_display *display, uint32_t code,
 static void
 wl_event_queue_init(struct wl_event_queue *queue, struct wl_display *display)
 {
-	wl_list_init(&queue->event_list);
+	queue->ring_head = 0;
+	queue->ring_tail = 0;
+	wl_list_init(&queue->overflow_list);
+	queue->overflow_count = 0;
+	pthread_mutex_init(&queue->mutex, NULL);
+	queue->recycled = NULL;
 	queue->display = display;
+	wl_list_insert(&display->queue_list, &queue->link);
+	wl_list_init(&queue->touched_link);
+	queue->event_fd = -1;
+	queue->coalesce = 0;
+	wl_list_init(&queue->coalesce_pending);
+	queue->coalesce_pending_count = 0;
+}
+
+static uint32_t
+queue_depth(struct wl_event_queue *queue)
+{
+	uint32_t head, tail;
+
+	head = __atomic_load_n(&queue->ring_head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&queue->ring_tail, __ATOMIC_ACQUIRE);
+
+	return tail - head +
+		__atomic_load_n(&queue->overflow_count, __ATOMIC_ACQUIRE);
+}
+
+/* The caller should hold the display lock */
+static void
+queue_push(struct wl_event_queue *queue, struct wl_closure *closure)
+{
+	uint32_t tail, head, depth;
+
+	tail = queue->ring_tail;
+	head = __atomic_load_n(&queue->ring_head, __ATOMIC_ACQUIRE);
+
+	/* Only the producer adds to the overflow list, so seeing it empty
+	 * here means it stays empty until we add to it ourselves. */
+	if (__atomic_load_n(&queue->overflow_count, __ATOMIC_ACQUIRE) == 0 &&
+	    tail - head < QUEUE_RING_SIZE) {
+		queue->ring[tail & (QUEUE_RING_SIZE - 1)] = closure;
+		__atomic_store_n(&queue->ring_tail, tail + 1, __ATOMIC_RELEASE);
+	} else {
+		pthread_mutex_lock(&queue->mutex);
+		wl_list_insert(queue->overflow_list.prev, &closure->link);
+		__atomic_store_n(&queue->overflow_count,
+				 queue->overflow_count + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&queue->mutex);
+	}
+
+	__atomic_store_n(&queue->events_queued, queue->events_queued + 1,
+			 __ATOMIC_RELAXED);
+	depth = queue_depth(queue);
+	if (depth > queue->max_depth)
+		__atomic_store_n(&queue->max_depth, depth, __ATOMIC_RELAXED);
+}
+
+/* The caller should hold the queue lock */
+static struct wl_closure *
+queue_pop(struct wl_event_queue *queue)
+{
+	struct wl_closure *closure;
+	uint32_t head;
+
+	head = queue->ring_head;
+	if (head != __atomic_load_n(&queue->ring_tail, __ATOMIC_ACQUIRE)) {
+		closure = queue->ring[head & (QUEUE_RING_SIZE - 1)];
+		__atomic_store_n(&queue->ring_head, head + 1, __ATOMIC_RELEASE);
+		return closure;
+	}
+
+	if (queue->overflow_count == 0)
+		return NULL;
+
+	closure = container_of(queue->overflow_list.next,
+			       struct wl_closure, link);
+	wl_list_remove(&closure->link);
+	__atomic_store_n(&queue->overflow_count, queue->overflow_count - 1,
+			 __ATOMIC_RELEASE);
+
+	return closure;
+}
+
+static bool
+queue_is_empty(struct wl_event_queue *queue)
+{
+	return __atomic_load_n(&queue->ring_head, __ATOMIC_ACQUIRE) ==
+		__atomic_load_n(&queue->ring_tail, __ATOMIC_ACQUIRE) &&
+		__atomic_load_n(&queue->overflow_count, __ATOMIC_ACQUIRE) == 0;
+}
+
+/* Called by the consumer once it has emptied the queue */
+static void
+queue_reset_fd(struct wl_event_queue *queue)
+{
+	uint64_t value;
+
+	if (read(queue->event_fd, &value, sizeof value) < 0 &&
+	    errno != EAGAIN)
+		return;
+
+	/* A reader may have queued more since the last pop; its signal
+	 * could have been consumed by the read above. */
+	if (!queue_is_empty(queue) ||
+	    __atomic_load_n(&queue->display->last_error, __ATOMIC_ACQUIRE))
+		queue_signal(queue);
+}
+
+/* Events that may be merged into an identical event still waiting on
+ * the queue.  Only events without object, new_id or fd arguments are
+ * listed here; key is an argument that must match for the events to be
+ * merged, and accumulate a fixed argument that is summed up.  All other
+ * arguments are taken from the latest event. */
+struct coalesce_rule {
+	const struct wl_interface *interface;
+	uint32_t opcode;
+	int key;
+	int accumulate;
+};
+
+static const struct coalesce_rule coalesce_rules[] = {
+	{ &wl_pointer_interface, 2 /* motion */, -1, -1 },
+	{ &wl_pointer_interface, 4 /* axis */, 1, 2 },
+	{ &wl_touch_interface, 2 /* motion */, 1, -1 },
+};
+
+static bool
+is_frame_event(struct wl_closure *closure)
+{
+	const struct wl_interface *interface =
+		closure->proxy->object.interface;
+
+	return (interface == &wl_pointer_interface && closure->opcode == 5) ||
+		(interface == &wl_touch_interface && closure->opcode == 3);
+}
+
+static const struct coalesce_rule *
+find_coalesce_rule(struct wl_proxy *proxy, uint32_t opcode)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(coalesce_rules); i++)
+		if (coalesce_rules[i].interface == proxy->object.interface &&
+		    coalesce_rules[i].opcode == opcode)
+			return &coalesce_rules[i];
+
+	return NULL;
+}
+
+/* Return the n-th closure counted from the end of the queue, or NULL.
+ * The caller should hold the queue lock, so none of them can be popped
+ * while we look at them. */
+static struct wl_closure *
+queue_peek_tail(struct wl_event_queue *queue, uint32_t n)
+{
+	struct wl_list *link;
+	uint32_t head, tail;
+
+	if (n < queue->overflow_count) {
+		link = queue->overflow_list.prev;
+		while (n--)
+			link = link->prev;
+		return container_of(link, struct wl_closure, link);
+	}
+
+	n -= queue->overflow_count;
+	head = queue->ring_head;
+	tail = queue->ring_tail;
+	if (n >= tail - head)
+		return NULL;
+
+	return queue->ring[(tail - 1 - n) & (QUEUE_RING_SIZE - 1)];
+}
+
+static bool
+coalesce_match(const struct coalesce_rule *rule, struct wl_closure *target,
+	       struct wl_proxy *proxy, struct wl_closure *closure)
+{
+	if (!target || target->proxy != proxy ||
+	    target->opcode != closure->opcode)
+		return false;
+
+	return rule->key < 0 ||
+		target->args[rule->key].u == closure->args[rule->key].u;
+}
+
+static bool
+coalesce_into(const struct coalesce_rule *rule, struct wl_closure *target,
+	      struct wl_proxy *proxy, struct wl_closure *closure)
+{
+	wl_fixed_t sum = 0;
+
+	if (!coalesce_match(rule, target, proxy, closure))
+		return false;
+
+	if (rule->accumulate >= 0)
+		sum = target->args[rule->accumulate].f +
+			closure->args[rule->accumulate].f;
+
+	memcpy(target->args, closure->args,
+	       closure->count * sizeof closure->args[0]);
+
+	if (rule->accumulate >= 0)
+		target->args[rule->accumulate].f = sum;
+
+	return true;
+}
+
+/* Proxies are referenced by queued closures, which are dropped by
+ * dispatching threads without the display mutex, so the refcount is
+ * atomic.  The reference owned by the application is only released by
+ * proxy_destroy(), so whoever drops the last one frees the proxy. */
+static inline void
+proxy_ref(struct wl_proxy *proxy)
+{
+	__atomic_add_fetch(&proxy->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+proxy_unref(struct wl_proxy *proxy)
+{
+	if (__atomic_sub_fetch(&proxy->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(proxy);
+}
+
+static inline bool
+proxy_is_destroyed(struct wl_proxy *proxy)
+{
+	return __atomic_load_n(&proxy->flags, __ATOMIC_ACQUIRE) &
+		WL_PROXY_FLAG_DESTROYED;
+}
+
+static void
+queue_recycle(struct wl_event_queue *queue, struct wl_closure *closure)
+{
+	struct wl_list *head;
+
+	head = __atomic_load_n(&queue->recycled, __ATOMIC_RELAXED);
+	do {
+		closure->link.next = head;
+	} while (!__atomic_compare_exchange_n(&queue->recycled, &head,
+					      &closure->link, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+/* The caller should hold the display lock */
+static void
+queue_recycle_closures(struct wl_event_queue *queue)
+{
+	struct wl_closure *closure;
+	struct wl_list *link;
+
+	link = __atomic_exchange_n(&queue->recycled, NULL, __ATOMIC_ACQUIRE);
+	while (link) {
+		closure = container_of(link, struct wl_closure, link);
+		link = link->next;
+		wl_closure_recycle(closure, queue->display->connection);
+	}
 }
 
 static void
@@ -238,12 +725,10 @@ decrease_closure_args_refcount(struct wl_closure *closure)
 		case 'o':
 			proxy = (struct wl_proxy *) closure->args[i].o;
 			if (proxy) {
-				if (proxy->flags & WL_PROXY_FLAG_DESTROYED)
+				if (proxy_is_destroyed(proxy))
 					closure->args[i].o = NULL;
 
-				proxy->refcount--;
-				if (!proxy->refcount)
-					free(proxy);
+				proxy_unref(proxy);
 			}
 			break;
 		default:
@@ -255,29 +740,26 @@ decrease_closure_args_refcount(struct wl_closure *closure)
 void
 proxy_destroy(struct wl_proxy *proxy);
 
+/* The caller should hold the display lock, or be the only thread left */
 static void
 wl_event_queue_release(struct wl_event_queue *queue)
 {
 	struct wl_closure *closure;
-	struct wl_proxy *proxy;
-	bool proxy_destroyed;
-
-	while (!wl_list_empty(&queue->event_list)) {
-		closure = container_of(queue->event_list.next,
-				       struct wl_closure, link);
-		wl_list_remove(&closure->link);
 
+	while ((closure = queue_pop(queue))) {
 		decrease_closure_args_refcount(closure);
+		proxy_unref(closure->proxy);
 
-		proxy = closure->proxy;
-		proxy_destroyed = !!(proxy->flags & WL_PROXY_FLAG_DESTROYED);
+		wl_closure_recycle(closure, queue->display->connection);
+	}
 
-		proxy->refcount--;
-		if (proxy_destroyed && !proxy->refcount)
-			free(proxy);
+	queue_recycle_closures(queue);
+	pthread_mutex_destroy(&queue->mutex);
 
-		wl_closure_destroy(closure);
-	}
+	wl_list_remove(&queue->link);
+	wl_list_remove(&queue->touched_link);
+	if (queue->event_fd >= 0)
+		close(queue->event_fd);
 }
 
 /** Destroy an event queue
@@ -321,11 +803,113 @@ wl_display_create_queue(struct wl_display *display)
 	if (queue == NULL)
 		return NULL;
 
+	pthread_mutex_lock(&display->mutex);
 	wl_event_queue_init(queue, display);
+	pthread_mutex_unlock(&display->mutex);
 
 	return queue;
 }
 
+/** Get a file descriptor signalling pending events on a queue
+ *
+ * \param queue The event queue
+ * \return A file descriptor, or -1 on failure with errno set
+ *
+ * Return a file descriptor that polls readable whenever events are
+ * queued on \c queue, so that a thread owning the queue can wait for it
+ * in its own poll loop instead of coordinating reads of the display fd
+ * with other threads. When it becomes readable, dispatch the queue with
+ * wl_display_dispatch_queue_pending(); the fd is reset once the queue is
+ * empty again. After a fatal display error it stays readable.
+ *
+ * The fd does not cause anything to be read from the display. Some other
+ * thread has to do that, typically the one started with
+ * wl_display_start_read_thread().
+ *
+ * The fd is created on first use and owned by the queue; it is closed
+ * when the queue is destroyed and must not be closed by the caller.
+ *
+ * \memberof wl_event_queue
+ */
+WL_EXPORT int
+wl_event_queue_get_fd(struct wl_event_queue *queue)
+{
+	struct wl_display *display = queue->display;
+	int fd;
+
+	pthread_mutex_lock(&display->mutex);
+
+	if (queue->event_fd < 0) {
+		queue->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (queue->event_fd >= 0 &&
+		    (!queue_is_empty(queue) || display->last_error))
+			queue_signal(queue);
+	}
+	fd = queue->event_fd;
+
+	pthread_mutex_unlock(&display->mutex);
+
+	return fd;
+}
+
+/** Get counters describing the traffic on an event queue
+ *
+ * \param queue The event queue
+ * \param stats Filled in with the counters
+ *
+ * Counts the events queued on and dispatched from \c queue since it was
+ * created, and how many are waiting now and were waiting at most. A
+ * growing depth means the queue is dispatched less often than the
+ * compositor sends events for it.
+ *
+ * \sa wl_display_get_stats()
+ *
+ * \memberof wl_event_queue
+ */
+WL_EXPORT void
+wl_event_queue_get_stats(struct wl_event_queue *queue,
+			 struct wl_event_queue_stats *stats)
+{
+	stats->events_queued = __atomic_load_n(&queue->events_queued,
+					       __ATOMIC_RELAXED);
+	stats->events_dispatched = __atomic_load_n(&queue->events_dispatched,
+						   __ATOMIC_RELAXED);
+	stats->depth = queue_depth(queue);
+	stats->max_depth = __atomic_load_n(&queue->max_depth,
+					   __ATOMIC_RELAXED);
+}
+
+/** Merge stale input events while they wait on a queue
+ *
+ * \param queue The event queue
+ * \param enable Non-zero to enable coalescing, zero to disable it
+ *
+ * When enabled, a wl_pointer.motion or wl_touch.motion event (for the
+ * same touch point) read while an identical event for the same proxy is
+ * still waiting on \c queue replaces the arguments of the waiting event
+ * instead of being queued. wl_pointer.axis events on the same axis are
+ * merged the same way, with their values added up.
+ *
+ * Frames are never split: a frame that directly follows a waiting frame
+ * of the same proxy is folded into it only if each of its events can be
+ * merged there, in which case its wl_pointer.frame or wl_touch.frame
+ * event is dropped. Otherwise the frame is queued unchanged. Events are
+ * never moved past events of other objects. This lets a thread that
+ * fell behind catch up with the latest input in one dispatch, at the
+ * cost of the intermediate positions.
+ *
+ * \memberof wl_event_queue
+ */
+WL_EXPORT void
+wl_event_queue_set_coalescing(struct wl_event_queue *queue, int enable)
+{
+	struct wl_display *display = queue->display;
+
+	pthread_mutex_lock(&display->mutex);
+	queue->coalesce = !!enable;
+	pthread_mutex_unlock(&display->mutex);
+}
+
 static struct wl_proxy *
 proxy_create(struct wl_proxy *factory, const struct wl_interface *interface,
 	     uint32_t version)
@@ -417,11 +1001,10 @@ proxy_destroy(struct wl_proxy *proxy)
 				 proxy->object.id, NULL);
 
 
-	proxy->flags |= WL_PROXY_FLAG_DESTROYED;
+	__atomic_fetch_or(&proxy->flags, WL_PROXY_FLAG_DESTROYED,
+			  __ATOMIC_RELEASE);
 
-	proxy->refcount--;
-	if (!proxy->refcount)
-		free(proxy);
+	proxy_unref(proxy);
 }
 
 /** Destroy a proxy object
@@ -440,19 +1023,76 @@ wl_proxy_destroy(struct wl_proxy *proxy)
 	pthread_mutex_unlock(&display->mutex);
 }
 
-/** Set a proxy's listener
+/* The caller should hold the display lock */
+static void
+proxy_update_ignored_events(struct wl_proxy *proxy)
+{
+	const struct wl_interface *interface = proxy->object.interface;
+	void (* const *implementation)(void) = proxy->object.implementation;
+	uint64_t ignored = 0;
+	int i;
+
+	if (!proxy->ignore_unhandled || proxy->dispatcher) {
+		proxy->ignored_events = 0;
+		return;
+	}
+
+	for (i = 0; i < interface->event_count && i < 64; i++) {
+		/* Objects created by the event must be tracked, and fds
+		 * have to be taken off the connection either way. */
+		if (strpbrk(interface->events[i].signature, "nh"))
+			continue;
+
+		if (!implementation || !implementation[i])
+			ignored |= (uint64_t) 1 << i;
+	}
+
+	proxy->ignored_events = ignored;
+}
+
+/** Drop events without a handler as soon as they are read
  *
  * \param proxy The proxy object
- * \param implementation The listener to be added to proxy
- * \param data User data to be associated with the proxy
- * \return 0 on success or -1 on failure
+ * \param enable Non-zero to drop unhandled events, zero to queue them
  *
- * Set proxy's listener to \c implementation and its user data to
- * \c data. If a listener has already been set, this function
- * fails and nothing is changed.
+ * By default every event is demarshalled and queued, and it is only
+ * discovered at dispatch time that the proxy has no listener, which drops
+ * it, or that its listener slot is NULL, which aborts. When enabled,
+ * events for which the listener currently set on \c proxy has a NULL slot,
+ * or all events if no listener is set, are discarded while reading,
+ * before any memory is allocated for them. Events that create objects or
+ * carry file descriptors are always queued.
  *
- * \c implementation is a vector of function pointers. For an opcode
- * \c n, \c implementation[n] should point to the handler of \c n for
+ * Events read before a listener is added are lost, so only enable this
+ * once the listener is set, or for proxies whose events are never
+ * needed.
+ *
+ * \memberof wl_proxy
+ */
+WL_EXPORT void
+wl_proxy_set_ignore_unhandled_events(struct wl_proxy *proxy, int enable)
+{
+	struct wl_display *display = proxy->display;
+
+	pthread_mutex_lock(&display->mutex);
+	proxy->ignore_unhandled = !!enable;
+	proxy_update_ignored_events(proxy);
+	pthread_mutex_unlock(&display->mutex);
+}
+
+/** Set a proxy's listener
+ *
+ * \param proxy The proxy object
+ * \param implementation The listener to be added to proxy
+ * \param data User data to be associated with the proxy
+ * \return 0 on success or -1 on failure
+ *
+ * Set proxy's listener to \c implementation and its user data to
+ * \c data. If a listener has already been set, this function
+ * fails and nothing is changed.
+ *
+ * \c implementation is a vector of function pointers. For an opcode
+ * \c n, \c implementation[n] should point to the handler of \c n for
  * the given object.
  *
  * \memberof wl_proxy
@@ -461,13 +1101,18 @@ WL_EXPORT int
 wl_proxy_add_listener(struct wl_proxy *proxy,
 		      void (**implementation)(void), void *data)
 {
+	struct wl_display *display = proxy->display;
+
 	if (proxy->object.implementation || proxy->dispatcher) {
 		wl_log("proxy %p already has listener\n", proxy);
 		return -1;
 	}
 
+	pthread_mutex_lock(&display->mutex);
 	proxy->object.implementation = implementation;
 	proxy->user_data = data;
+	proxy_update_ignored_events(proxy);
+	pthread_mutex_unlock(&display->mutex);
 
 	return 0;
 }
@@ -514,14 +1159,19 @@ wl_proxy_add_dispatcher(struct wl_proxy *proxy,
 			wl_dispatcher_func_t dispatcher,
 			const void *implementation, void *data)
 {
+	struct wl_display *display = proxy->display;
+
 	if (proxy->object.implementation || proxy->dispatcher) {
 		wl_log("proxy %p already has listener\n", proxy);
 		return -1;
 	}
 
+	pthread_mutex_lock(&display->mutex);
 	proxy->object.implementation = implementation;
 	proxy->dispatcher = dispatcher;
 	proxy->user_data = data;
+	proxy_update_ignored_events(proxy);
+	pthread_mutex_unlock(&display->mutex);
 
 	return 0;
 }
@@ -589,6 +1239,108 @@ wl_proxy_marshal_array_constructor(struct wl_proxy *proxy,
 }
 
 
+/* The caller should hold the display lock */
+static int
+display_flush_locked(struct wl_display *display)
+{
+	int ret;
+
+	if (display->last_error) {
+		errno = display->last_error;
+		return -1;
+	}
+
+	/* We don't make EPIPE a fatal error here, so that we may try to
+	 * read events after the failed flush. When the compositor sends
+	 * an error it will close the socket, and if we make EPIPE fatal
+	 * here we don't get a chance to process the error. */
+	ret = wl_connection_flush(display->connection);
+	if (ret >= 0)
+		display->unflushed_messages = 0;
+	else if (errno != EAGAIN && errno != EPIPE)
+		display_fatal_error(display, errno);
+
+	return ret;
+}
+
+/* The caller should hold the display lock */
+static bool
+display_flush_due(struct wl_display *display)
+{
+	if (display->cork_count > 0)
+		return false;
+
+	if ((display->flush_flags & WL_DISPLAY_FLUSH_BYTES) &&
+	    wl_connection_pending_output(display->connection) >=
+	    display->flush_bytes)
+		return true;
+
+	if ((display->flush_flags & WL_DISPLAY_FLUSH_MESSAGES) &&
+	    display->unflushed_messages >= display->flush_messages)
+		return true;
+
+	return false;
+}
+
+/* Flush on behalf of the flush policy.  If the socket is full the data
+ * simply stays buffered until the next flush. */
+static void
+display_auto_flush(struct wl_display *display)
+{
+	int saved_errno = errno;
+
+	display_flush_locked(display);
+	errno = saved_errno;
+}
+
+/* The caller should hold the display lock.  No event for the new proxy
+ * can be queued before the lock is released, so the caller may still
+ * set up its listener and queue. */
+static struct wl_proxy *
+proxy_marshal_array_locked(struct wl_proxy *proxy, uint32_t opcode,
+			   union wl_argument *args,
+			   const struct wl_interface *interface,
+			   uint32_t version)
+{
+	struct wl_closure *closure;
+	struct wl_proxy *new_proxy = NULL;
+	const struct wl_message *message;
+
+	message = &proxy->object.interface->methods[opcode];
+	if (interface) {
+		new_proxy = create_outgoing_proxy(proxy, message,
+						  args, interface,
+						  version);
+		if (new_proxy == NULL)
+			return NULL;
+	}
+
+	closure = wl_closure_marshal(&proxy->object, opcode, args, message);
+	if (closure == NULL)
+		wl_abort("Error marshalling request: %s\n", strerror(errno));
+
+	if (debug_client)
+		wl_closure_print(closure, &proxy->object, true);
+
+	/* A full socket only leaves the request queued on the connection,
+	 * so failing to send means the connection is unusable. */
+	if (wl_closure_send(closure, proxy->display->connection)) {
+		wl_log("Error sending request: %s\n", strerror(errno));
+		display_fatal_error(proxy->display, errno);
+		wl_closure_destroy(closure);
+		return new_proxy;
+	}
+
+	wl_closure_destroy(closure);
+
+	proxy->display->messages_sent++;
+	proxy->display->unflushed_messages++;
+	if (display_flush_due(proxy->display))
+		display_auto_flush(proxy->display);
+
+	return new_proxy;
+}
+
 /** Prepare a request to be sent to the compositor
  *
  * \param proxy The proxy object
@@ -620,34 +1372,11 @@ wl_proxy_marshal_array_constructor_versioned(struct wl_proxy *proxy,
 					     const struct wl_interface *interface,
 					     uint32_t version)
 {
-	struct wl_closure *closure;
-	struct wl_proxy *new_proxy = NULL;
-	const struct wl_message *message;
+	struct wl_proxy *new_proxy;
 
 	pthread_mutex_lock(&proxy->display->mutex);
-
-	message = &proxy->object.interface->methods[opcode];
-	if (interface) {
-		new_proxy = create_outgoing_proxy(proxy, message,
-						  args, interface,
-						  version);
-		if (new_proxy == NULL)
-			goto err_unlock;
-	}
-
-	closure = wl_closure_marshal(&proxy->object, opcode, args, message);
-	if (closure == NULL)
-		wl_abort("Error marshalling request: %s\n", strerror(errno));
-
-	if (debug_client)
-		wl_closure_print(closure, &proxy->object, true);
-
-	if (wl_closure_send(closure, proxy->display->connection))
-		wl_abort("Error sending request: %s\n", strerror(errno));
-
-	wl_closure_destroy(closure);
-
- err_unlock:
+	new_proxy = proxy_marshal_array_locked(proxy, opcode, args,
+					       interface, version);
 	pthread_mutex_unlock(&proxy->display->mutex);
 
 	return new_proxy;
@@ -811,7 +1540,8 @@ display_handle_delete_id(void *data, struct wl_display *display, uint32_t id)
 		wl_log("error: received delete_id for unknown id (%u)\n", id);
 
 	if (proxy && proxy != WL_ZOMBIE_OBJECT)
-		proxy->flags |= WL_PROXY_FLAG_ID_DELETED;
+		__atomic_fetch_or(&proxy->flags, WL_PROXY_FLAG_ID_DELETED,
+				  __ATOMIC_RELAXED);
 	else
 		wl_map_remove(&display->objects, id);
 
@@ -905,10 +1635,12 @@ wl_display_connect_to_fd(int fd)
 
 	display->fd = fd;
 	wl_map_init(&display->objects, WL_MAP_CLIENT_SIDE);
+	wl_list_init(&display->queue_list);
+	wl_list_init(&display->touched_list);
+	wl_list_init(&display->reader_waiters);
 	wl_event_queue_init(&display->default_queue, display);
 	wl_event_queue_init(&display->display_queue, display);
 	pthread_mutex_init(&display->mutex, NULL);
-	pthread_cond_init(&display->reader_cond, NULL);
 	display->reader_count = 0;
 
 	wl_map_insert_new(&display->objects, 0, NULL);
@@ -946,11 +1678,17 @@ wl_display_connect_to_fd(int fd)
 	if (display->connection == NULL)
 		goto err_connection;
 
+	/* Keep requests that don't fit in the out buffer while the
+	 * compositor isn't draining the socket queued until a later
+	 * flush, rather than blocking or failing. */
+	wl_connection_set_queue_when_full(display->connection, 1);
+
 	return display;
 
  err_connection:
+	pthread_mutex_destroy(&display->default_queue.mutex);
+	pthread_mutex_destroy(&display->display_queue.mutex);
 	pthread_mutex_destroy(&display->mutex);
-	pthread_cond_destroy(&display->reader_cond);
 	wl_map_release(&display->objects);
 	close(display->fd);
 	free(display);
@@ -1009,12 +1747,13 @@ wl_display_connect(const char *name)
 WL_EXPORT void
 wl_display_disconnect(struct wl_display *display)
 {
-	wl_connection_destroy(display->connection);
-	wl_map_release(&display->objects);
+	wl_display_stop_read_thread(display);
+
 	wl_event_queue_release(&display->default_queue);
 	wl_event_queue_release(&display->display_queue);
+	wl_connection_destroy(display->connection);
+	wl_map_release(&display->objects);
 	pthread_mutex_destroy(&display->mutex);
-	pthread_cond_destroy(&display->reader_cond);
 	close(display->fd);
 
 	free(display);
@@ -1166,7 +1905,7 @@ increase_closure_args_refcount(struct wl_closure *closure)
 		case 'o':
 			proxy = (struct wl_proxy *) closure->args[i].o;
 			if (proxy)
-				proxy->refcount++;
+				proxy_ref(proxy);
 			break;
 		default:
 			break;
@@ -1174,6 +1913,174 @@ increase_closure_args_refcount(struct wl_closure *closure)
 	}
 }
 
+/* Queue a closure that was read for proxy; the caller should hold the
+ * display lock. */
+static void
+queue_closure(struct wl_display *display, struct wl_event_queue *queue,
+	      struct wl_proxy *proxy, struct wl_closure *closure)
+{
+	increase_closure_args_refcount(closure);
+	proxy_ref(proxy);
+	closure->proxy = proxy;
+
+	queue_push(queue, closure);
+	if (__atomic_load_n(&queue->recycled, __ATOMIC_RELAXED))
+		queue_recycle_closures(queue);
+
+	if (wl_list_empty(&queue->touched_link))
+		wl_list_insert(&display->touched_list, &queue->touched_link);
+}
+
+/* Queue the events held back by queue_coalesce() as they are */
+static void
+queue_flush_coalesced(struct wl_display *display, struct wl_event_queue *queue)
+{
+	struct wl_closure *closure;
+
+	while (!wl_list_empty(&queue->coalesce_pending)) {
+		closure = container_of(queue->coalesce_pending.next,
+				       struct wl_closure, link);
+		wl_list_remove(&closure->link);
+		queue_closure(display, queue, closure->proxy, closure);
+	}
+
+	queue->coalesce_pending_count = 0;
+}
+
+/* Held back events never outlive the read that produced them.  Queues
+ * holding events are on the touched list. */
+static void
+display_flush_coalesced(struct wl_display *display)
+{
+	struct wl_event_queue *queue;
+
+	wl_list_for_each(queue, &display->touched_list, touched_link)
+		queue_flush_coalesced(display, queue);
+}
+
+/* Fold the held back events of a new frame into the frame of the same
+ * proxy at the end of the queue.  This only happens if every one of
+ * them has a counterpart there, so that a frame is merged as a whole or
+ * not at all.  The caller should hold the display lock. */
+static bool
+queue_fold_frame(struct wl_display *display, struct wl_event_queue *queue,
+		 struct wl_proxy *proxy)
+{
+	struct wl_closure *targets[COALESCE_FRAME_MAX];
+	const struct coalesce_rule *rule;
+	struct wl_closure *closure, *old, *tmp;
+	uint32_t i, n;
+	bool folded = false;
+
+	pthread_mutex_lock(&queue->mutex);
+
+	/* The previous frame may have been dispatched meanwhile */
+	old = queue_peek_tail(queue, 0);
+	if (!old || old->proxy != proxy || !is_frame_event(old))
+		goto out;
+
+	i = 0;
+	wl_list_for_each(closure, &queue->coalesce_pending, link) {
+		rule = find_coalesce_rule(proxy, closure->opcode);
+		targets[i] = NULL;
+		for (n = 1; (old = queue_peek_tail(queue, n)); n++) {
+			if (old->proxy != proxy || is_frame_event(old))
+				break;
+			if (coalesce_match(rule, old, proxy, closure)) {
+				targets[i] = old;
+				break;
+			}
+		}
+		if (!targets[i])
+			goto out;
+		i++;
+	}
+
+	i = 0;
+	wl_list_for_each_safe(closure, tmp, &queue->coalesce_pending, link) {
+		rule = find_coalesce_rule(proxy, closure->opcode);
+		coalesce_into(rule, targets[i++], proxy, closure);
+		wl_list_remove(&closure->link);
+		wl_closure_recycle(closure, display->connection);
+	}
+	queue->coalesce_pending_count = 0;
+	folded = true;
+
+out:
+	pthread_mutex_unlock(&queue->mutex);
+
+	return folded;
+}
+
+enum coalesce_result {
+	COALESCE_NONE,
+	COALESCE_MERGED,
+	COALESCE_HELD
+};
+
+/* Try to fold a freshly read event into the events still waiting on the
+ * queue.  Within a frame that is still open, an event is merged into the
+ * last queued one if they match.  When a new frame starts right after a
+ * complete frame of the same proxy, its events are held back until its
+ * frame event arrives and then folded into the previous frame as a
+ * whole, with the new frame event dropped, or queued unchanged.  Any
+ * other event queued meanwhile lets the held back events go first, so
+ * the order of events is kept.  The caller should hold the display
+ * lock. */
+static enum coalesce_result
+queue_coalesce(struct wl_display *display, struct wl_event_queue *queue,
+	       struct wl_proxy *proxy, struct wl_closure *closure)
+{
+	const struct coalesce_rule *rule;
+	struct wl_closure *tail;
+	enum coalesce_result result = COALESCE_NONE;
+
+	rule = find_coalesce_rule(proxy, closure->opcode);
+
+	if (!wl_list_empty(&queue->coalesce_pending)) {
+		tail = container_of(queue->coalesce_pending.prev,
+				    struct wl_closure, link);
+		if (tail->proxy == proxy && is_frame_event(closure) &&
+		    queue_fold_frame(display, queue, proxy))
+			return COALESCE_MERGED;
+
+		if (tail->proxy == proxy && rule &&
+		    queue->coalesce_pending_count < COALESCE_FRAME_MAX) {
+			if (coalesce_into(rule, tail, proxy, closure))
+				return COALESCE_MERGED;
+
+			wl_list_insert(queue->coalesce_pending.prev,
+				       &closure->link);
+			queue->coalesce_pending_count++;
+			return COALESCE_HELD;
+		}
+
+		queue_flush_coalesced(display, queue);
+		return COALESCE_NONE;
+	}
+
+	if (!rule)
+		return COALESCE_NONE;
+
+	pthread_mutex_lock(&queue->mutex);
+
+	tail = queue_peek_tail(queue, 0);
+	if (tail && tail->proxy == proxy && is_frame_event(tail)) {
+		wl_list_insert(queue->coalesce_pending.prev, &closure->link);
+		queue->coalesce_pending_count = 1;
+		if (wl_list_empty(&queue->touched_link))
+			wl_list_insert(&display->touched_list,
+				       &queue->touched_link);
+		result = COALESCE_HELD;
+	} else if (coalesce_into(rule, tail, proxy, closure)) {
+		result = COALESCE_MERGED;
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+
+	return result;
+}
+
 static int
 queue_event(struct wl_display *display, int len)
 {
@@ -1191,6 +2098,8 @@ queue_event(struct wl_display *display, int len)
 	if (len < size)
 		return 0;
 
+	display->messages_received++;
+
 	proxy = wl_map_lookup(&display->objects, id);
 	if (proxy == WL_ZOMBIE_OBJECT) {
 		wl_connection_consume(display->connection, size);
@@ -1200,66 +2109,77 @@ queue_event(struct wl_display *display, int len)
 		return size;
 	}
 
+	if (opcode < 64 && proxy->ignored_events & ((uint64_t) 1 << opcode)) {
+		wl_connection_consume(display->connection, size);
+		return size;
+	}
+
 	message = &proxy->object.interface->events[opcode];
 	closure = wl_connection_demarshal(display->connection, size,
 					  &display->objects, message);
 	if (!closure)
 		return -1;
 
+	if (proxy == &display->proxy)
+		queue = &display->display_queue;
+	else
+		queue = proxy->queue;
+
+	if (queue->coalesce) {
+		closure->proxy = proxy;
+		switch (queue_coalesce(display, queue, proxy, closure)) {
+		case COALESCE_MERGED:
+			wl_closure_recycle(closure, display->connection);
+			return size;
+		case COALESCE_HELD:
+			return size;
+		case COALESCE_NONE:
+			break;
+		}
+	}
+
 	if (create_proxies(proxy, closure) < 0) {
-		wl_closure_destroy(closure);
+		wl_closure_recycle(closure, display->connection);
 		return -1;
 	}
 
 	if (wl_closure_lookup_objects(closure, &display->objects) != 0) {
-		wl_closure_destroy(closure);
+		wl_closure_recycle(closure, display->connection);
 		return -1;
 	}
 
-	increase_closure_args_refcount(closure);
-	proxy->refcount++;
-	closure->proxy = proxy;
-
-	if (proxy == &display->proxy)
-		queue = &display->display_queue;
-	else
-		queue = proxy->queue;
-
-	wl_list_insert(queue->event_list.prev, &closure->link);
+	queue_closure(display, queue, proxy, closure);
 
 	return size;
 }
 
+/* Called with queue->mutex held; the display mutex is not needed */
 static void
-dispatch_event(struct wl_display *display, struct wl_event_queue *queue)
+dispatch_event(struct wl_display *display, struct wl_event_queue *queue,
+	       struct wl_closure *closure)
 {
-	struct wl_closure *closure;
 	struct wl_proxy *proxy;
 	int opcode;
-	bool proxy_destroyed;
 
-	closure = container_of(queue->event_list.next,
-			       struct wl_closure, link);
-	wl_list_remove(&closure->link);
 	opcode = closure->opcode;
 
+	__atomic_store_n(&queue->events_dispatched,
+			 queue->events_dispatched + 1, __ATOMIC_RELAXED);
+
 	/* Verify that the receiving object is still valid by checking if has
-	 * been destroyed by the application. */
+	 * been destroyed by the application.  The closure's reference keeps
+	 * the proxy alive until the handler returns. */
 
 	decrease_closure_args_refcount(closure);
 	proxy = closure->proxy;
-	proxy_destroyed = !!(proxy->flags & WL_PROXY_FLAG_DESTROYED);
-
-	proxy->refcount--;
-	if (proxy_destroyed) {
-		if (!proxy->refcount)
-			free(proxy);
 
-		wl_closure_destroy(closure);
+	if (proxy_is_destroyed(proxy)) {
+		proxy_unref(proxy);
+		queue_recycle(queue, closure);
 		return;
 	}
 
-	pthread_mutex_unlock(&display->mutex);
+	pthread_mutex_unlock(&queue->mutex);
 
 	if (proxy->dispatcher) {
 		if (debug_client)
@@ -1275,72 +2195,95 @@ dispatch_event(struct wl_display *display, struct wl_event_queue *queue)
 				  &proxy->object, opcode, proxy->user_data);
 	}
 
-	wl_closure_destroy(closure);
+	proxy_unref(proxy);
+	queue_recycle(queue, closure);
 
-	pthread_mutex_lock(&display->mutex);
+	pthread_mutex_lock(&queue->mutex);
 }
 
 static int
-read_events(struct wl_display *display)
+wl_display_poll(struct wl_display *display, short int events)
 {
+	int ret;
+	struct pollfd pfd[1];
+	uint64_t start = monotonic_ns();
+
+	pfd[0].fd = display->fd;
+	pfd[0].events = events;
+	do {
+		ret = poll(pfd, 1, -1);
+	} while (ret == -1 && errno == EINTR);
+
+	if (events & POLLIN)
+		display_add_read_wait(display, start);
+
+	return ret;
+}
+
+static void
+cancel_read(struct wl_display *display)
+{
+	display->reader_count--;
+	if (display->reader_count == 0)
+		display_wakeup_threads(display);
+}
+
+static int
+read_events(struct wl_display *display, struct wl_event_queue *queue)
+{
+	struct reader_waiter waiter;
 	int total, rem, size;
-	uint32_t serial;
 
 	display->reader_count--;
-	if (display->reader_count == 0) {
-		total = wl_connection_read(display->connection);
-		if (total == -1) {
-			if (errno == EAGAIN) {
-				/* we must wake up threads whenever
-				 * the reader_count dropped to 0 */
-				display_wakeup_threads(display);
-
-				return 0;
-			}
+	if (display->reader_count > 0) {
+		waiter.queue = queue;
+		waiter.can_read = 1;
+		display_wait(display, &waiter);
 
-			display_fatal_error(display, errno);
-			return -1;
-		} else if (total == 0) {
-			/* The compositor has closed the socket. This
-			 * should be considered an error so we'll fake
-			 * an errno */
-			errno = EPIPE;
-			display_fatal_error(display, errno);
+		if (display->last_error) {
+			errno = display->last_error;
 			return -1;
 		}
 
-		for (rem = total; rem >= 8; rem -= size) {
-			size = queue_event(display, rem);
-			if (size == -1) {
-				display_fatal_error(display, errno);
-				return -1;
-			} else if (size == 0) {
-				break;
-			}
+		return 0;
+	}
+
+	total = wl_connection_read(display->connection);
+	if (total == -1) {
+		if (errno == EAGAIN) {
+			/* we must wake up threads whenever
+			 * the reader_count dropped to 0 */
+			display_wakeup_threads(display);
+
+			return 0;
 		}
 
-		display_wakeup_threads(display);
-	} else {
-		serial = display->read_serial;
-		while (display->read_serial == serial)
-			pthread_cond_wait(&display->reader_cond,
-					  &display->mutex);
+		display_fatal_error(display, errno);
+		return -1;
+	} else if (total == 0) {
+		/* The compositor has closed the socket. This
+		 * should be considered an error so we'll fake
+		 * an errno */
+		errno = EPIPE;
+		display_fatal_error(display, errno);
+		return -1;
+	}
 
-		if (display->last_error) {
-			errno = display->last_error;
+	for (rem = total; rem >= 8; rem -= size) {
+		size = queue_event(display, rem);
+		if (size == -1) {
+			display_flush_coalesced(display);
+			display_fatal_error(display, errno);
 			return -1;
+		} else if (size == 0) {
+			break;
 		}
 	}
 
-	return 0;
-}
+	display_flush_coalesced(display);
+	display_signal_touched_queues(display);
 
-static void
-cancel_read(struct wl_display *display)
-{
-	display->reader_count--;
-	if (display->reader_count == 0)
-		display_wakeup_threads(display);
+	return 0;
 }
 
 /** Read events from display file descriptor
@@ -1362,8 +2305,14 @@ cancel_read(struct wl_display *display)
  * function will sleep until all other prepared threads have either been
  * cancelled (using wl_display_cancel_read()) or them self entered this
  * function. The last thread that calls this function will then read and queue
- * events on their corresponding event queues, and finally wake up all other
- * wl_display_read_events() calls causing them to return.
+ * events on their corresponding event queues, and finally wake up the other
+ * wl_display_read_events() calls whose thread prepared with a queue that
+ * received events. Threads that prepared with wl_display_prepare_read_queue()
+ * for another queue keep sleeping. If no other thread is prepared to read,
+ * one of them returns anyway, without events for its queue, so that its
+ * caller prepares and reads again; callers must therefore expect this
+ * function to return with nothing queued. If the read finds no data, or an
+ * error occurs, all waiting threads return.
  *
  * If a thread cancels a read preparation when all other threads that have
  * prepared to read has either called wl_display_cancel_read() or
@@ -1381,8 +2330,11 @@ cancel_read(struct wl_display *display)
 WL_EXPORT int
 wl_display_read_events(struct wl_display *display)
 {
+	struct wl_event_queue *queue;
 	int ret;
 
+	queue = take_prepared_queue(display);
+
 	pthread_mutex_lock(&display->mutex);
 
 	if (display->last_error) {
@@ -1393,7 +2345,7 @@ wl_display_read_events(struct wl_display *display)
 		return -1;
 	}
 
-	ret = read_events(display);
+	ret = read_events(display, queue);
 
 	pthread_mutex_unlock(&display->mutex);
 
@@ -1401,32 +2353,58 @@ wl_display_read_events(struct wl_display *display)
 }
 
 static int
-dispatch_queue(struct wl_display *display, struct wl_event_queue *queue)
+display_get_error(struct wl_display *display)
 {
-	int count;
+	return __atomic_load_n(&display->last_error, __ATOMIC_ACQUIRE);
+}
 
-	if (display->last_error)
-		goto err;
+/* Dispatch every event on a queue, taking only that queue's lock */
+static int
+dispatch_queue_locked(struct wl_display *display,
+		      struct wl_event_queue *queue)
+{
+	struct wl_closure *closure;
+	int count = 0;
 
-	count = 0;
-	while (!wl_list_empty(&display->display_queue.event_list)) {
-		dispatch_event(display, &display->display_queue);
-		if (display->last_error)
-			goto err;
-		count++;
-	}
+	pthread_mutex_lock(&queue->mutex);
 
-	while (!wl_list_empty(&queue->event_list)) {
-		dispatch_event(display, queue);
-		if (display->last_error)
-			goto err;
+	while ((closure = queue_pop(queue))) {
+		dispatch_event(display, queue, closure);
+		if (display_get_error(display)) {
+			count = -1;
+			break;
+		}
 		count++;
 	}
 
+	if (count >= 0 && queue->event_fd >= 0)
+		queue_reset_fd(queue);
+
+	pthread_mutex_unlock(&queue->mutex);
+
 	return count;
+}
+
+static int
+dispatch_queue(struct wl_display *display, struct wl_event_queue *queue)
+{
+	int count, ret;
+
+	if (display_get_error(display))
+		goto err;
+
+	count = dispatch_queue_locked(display, &display->display_queue);
+	if (count < 0)
+		goto err;
+
+	ret = dispatch_queue_locked(display, queue);
+	if (ret < 0)
+		goto err;
+
+	return count + ret;
 
 err:
-	errno = display->last_error;
+	errno = display_get_error(display);
 
 	return -1;
 }
@@ -1493,71 +2471,265 @@ wl_display_prepare_read_queue(struct wl_display *display,
 
 	pthread_mutex_lock(&display->mutex);
 
-	if (!wl_list_empty(&queue->event_list)) {
+	/* Events are only added by a reader, which needs the display
+	 * mutex, so the queue cannot fill up behind our back here. */
+	if (!queue_is_empty(queue)) {
 		errno = EAGAIN;
 		ret = -1;
 	} else {
 		display->reader_count++;
 		ret = 0;
+
+		if ((display->flush_flags & WL_DISPLAY_FLUSH_BEFORE_READ) &&
+		    display->cork_count == 0)
+			display_auto_flush(display);
 	}
 
 	pthread_mutex_unlock(&display->mutex);
 
+	if (ret == 0)
+		set_prepared_queue(queue);
+
 	return ret;
 }
 
-/** Prepare to read events from the display's file descriptor
- *
- * \param display The display context object
- * \return 0 on success or -1 if event queue was not empty
- *
- * This function does the same thing as wl_display_prepare_read_queue()
- * with the default queue passed as the queue.
- *
- * \sa wl_display_prepare_read_queue
- * \memberof wl_display
- */
-WL_EXPORT int
-wl_display_prepare_read(struct wl_display *display)
-{
-	return wl_display_prepare_read_queue(display, &display->default_queue);
+/** Prepare to read events from the display's file descriptor
+ *
+ * \param display The display context object
+ * \return 0 on success or -1 if event queue was not empty
+ *
+ * This function does the same thing as wl_display_prepare_read_queue()
+ * with the default queue passed as the queue.
+ *
+ * \sa wl_display_prepare_read_queue
+ * \memberof wl_display
+ */
+WL_EXPORT int
+wl_display_prepare_read(struct wl_display *display)
+{
+	return wl_display_prepare_read_queue(display, &display->default_queue);
+}
+
+/** Cancel read intention on display's fd
+ *
+ * \param display The display context object
+ *
+ * After a thread successfully called wl_display_prepare_read() it must
+ * either call wl_display_read_events() or wl_display_cancel_read().
+ * If the threads do not follow this rule it will lead to deadlock.
+ *
+ * \sa wl_display_prepare_read(), wl_display_read_events()
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT void
+wl_display_cancel_read(struct wl_display *display)
+{
+	take_prepared_queue(display);
+
+	pthread_mutex_lock(&display->mutex);
+
+	cancel_read(display);
+
+	pthread_mutex_unlock(&display->mutex);
+}
+
+static void *
+read_thread_main(void *data)
+{
+	struct wl_display *display = data;
+	struct pollfd pfd[2];
+	int ret;
+
+	pfd[0].fd = display->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = display->read_thread_stop_fd;
+	pfd[1].events = POLLIN;
+
+	while (true) {
+		/* Take part in the usual reader protocol, so that
+		 * threads using wl_display_prepare_read() still work. */
+		pthread_mutex_lock(&display->mutex);
+		if (display->last_error) {
+			pthread_mutex_unlock(&display->mutex);
+			break;
+		}
+		display->reader_count++;
+		if ((display->flush_flags & WL_DISPLAY_FLUSH_BEFORE_READ) &&
+		    display->cork_count == 0)
+			display_auto_flush(display);
+		pthread_mutex_unlock(&display->mutex);
+
+		do {
+			ret = poll(pfd, 2, -1);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret == -1) {
+			pthread_mutex_lock(&display->mutex);
+			cancel_read(display);
+			display_fatal_error(display, errno);
+			pthread_mutex_unlock(&display->mutex);
+			break;
+		}
+
+		if (pfd[1].revents) {
+			wl_display_cancel_read(display);
+			break;
+		}
+
+		if (wl_display_read_events(display) == -1)
+			break;
+	}
+
+	return NULL;
+}
+
+/** Start a library-owned thread reading from the display fd
+ *
+ * \param display The display context object
+ * \return 0 on success or -1 on failure, with errno set
+ *
+ * Start a thread that continuously reads from the display fd and queues
+ * incoming events on their event queues, so that demarshalling happens in
+ * the background. While it runs, wl_display_dispatch_queue() and the
+ * functions built on it no longer read themselves: they flush, wait
+ * until the reader thread has queued events for the given queue, and
+ * dispatch them. Event handlers still run only in the threads that
+ * dispatch their queues.
+ *
+ * The thread takes part in the wl_display_prepare_read() protocol, but a
+ * thread that prepares to read and then blocks elsewhere also holds up
+ * the reader thread, so applications using this mode should wait with
+ * wl_display_dispatch_queue() instead. All signals are blocked in the
+ * reader thread.
+ *
+ * Calling this function while the thread is already running does
+ * nothing.
+ *
+ * \sa wl_display_stop_read_thread()
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT int
+wl_display_start_read_thread(struct wl_display *display)
+{
+	sigset_t all, saved;
+	int ret;
+
+	pthread_mutex_lock(&display->mutex);
+
+	if (display->read_thread_running) {
+		pthread_mutex_unlock(&display->mutex);
+		return 0;
+	}
+
+	if (display->last_error) {
+		errno = display->last_error;
+		goto err_unlock;
+	}
+
+	display->read_thread_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (display->read_thread_stop_fd < 0)
+		goto err_unlock;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	ret = pthread_create(&display->read_thread, NULL,
+			     read_thread_main, display);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (ret != 0) {
+		close(display->read_thread_stop_fd);
+		errno = ret;
+		goto err_unlock;
+	}
+
+	display->read_thread_running = 1;
+
+	pthread_mutex_unlock(&display->mutex);
+
+	return 0;
+
+err_unlock:
+	pthread_mutex_unlock(&display->mutex);
+
+	return -1;
 }
 
-/** Cancel read intention on display's fd
+/** Stop the library-owned reader thread
  *
  * \param display The display context object
  *
- * After a thread successfully called wl_display_prepare_read() it must
- * either call wl_display_read_events() or wl_display_cancel_read().
- * If the threads do not follow this rule it will lead to deadlock.
+ * Stop the thread started with wl_display_start_read_thread() and wait
+ * for it to exit. Events it has already queued stay on their queues.
+ * Threads waiting in wl_display_dispatch_queue() return, and from then
+ * on reading is done by the dispatching threads again. This must not be
+ * called from an event handler while another thread is prepared to read.
  *
- * \sa wl_display_prepare_read(), wl_display_read_events()
+ * wl_display_disconnect() stops the thread implicitly.
  *
  * \memberof wl_display
  */
 WL_EXPORT void
-wl_display_cancel_read(struct wl_display *display)
+wl_display_stop_read_thread(struct wl_display *display)
 {
+	struct reader_waiter *waiter, *tmp;
+	uint64_t value = 1;
+	int running;
+
 	pthread_mutex_lock(&display->mutex);
+	running = display->read_thread_running;
+	pthread_mutex_unlock(&display->mutex);
 
-	cancel_read(display);
+	if (!running)
+		return;
+
+	if (write(display->read_thread_stop_fd, &value, sizeof value) < 0)
+		wl_log("failed to stop reader thread: %m\n");
+
+	pthread_join(display->read_thread, NULL);
+	close(display->read_thread_stop_fd);
 
+	/* Wake up dispatchers waiting for the thread, but leave threads
+	 * sleeping in read_events() alone. */
+	pthread_mutex_lock(&display->mutex);
+	display->read_thread_running = 0;
+	wl_list_for_each_safe(waiter, tmp, &display->reader_waiters, link)
+		if (!waiter->can_read)
+			display_wake_waiter(waiter, WAITER_DONE);
 	pthread_mutex_unlock(&display->mutex);
 }
 
 static int
-wl_display_poll(struct wl_display *display, short int events)
+dispatch_queue_read_thread(struct wl_display *display,
+			   struct wl_event_queue *queue)
 {
+	struct reader_waiter waiter;
 	int ret;
-	struct pollfd pfd[1];
 
-	pfd[0].fd = display->fd;
-	pfd[0].events = events;
-	do {
-		ret = poll(pfd, 1, -1);
-	} while (ret == -1 && errno == EINTR);
+	if (queue_is_empty(queue)) {
+		while ((ret = wl_display_flush(display)) == -1 &&
+		       errno == EAGAIN) {
+			if (wl_display_poll(display, POLLOUT) == -1)
+				return -1;
+		}
 
-	return ret;
+		if (ret < 0 && errno != EPIPE)
+			return -1;
+
+		/* The reader thread wakes us once it queued events here;
+		 * an error or stopping the thread wakes us as well. */
+		pthread_mutex_lock(&display->mutex);
+		while (queue_is_empty(queue) && !display->last_error &&
+		       display->read_thread_running) {
+			waiter.queue = queue;
+			waiter.can_read = 0;
+			display_wait(display, &waiter);
+		}
+		pthread_mutex_unlock(&display->mutex);
+	}
+
+	return wl_display_dispatch_queue_pending(display, queue);
 }
 
 /** Dispatch events in an event queue
@@ -1603,7 +2775,14 @@ WL_EXPORT int
 wl_display_dispatch_queue(struct wl_display *display,
 			  struct wl_event_queue *queue)
 {
-	int ret;
+	int ret, threaded;
+
+	pthread_mutex_lock(&display->mutex);
+	threaded = display->read_thread_running;
+	pthread_mutex_unlock(&display->mutex);
+
+	if (threaded)
+		return dispatch_queue_read_thread(display, queue);
 
 	if (wl_display_prepare_read_queue(display, queue) == -1)
 		return wl_display_dispatch_queue_pending(display, queue);
@@ -1655,15 +2834,7 @@ WL_EXPORT int
 wl_display_dispatch_queue_pending(struct wl_display *display,
 				  struct wl_event_queue *queue)
 {
-	int ret;
-
-	pthread_mutex_lock(&display->mutex);
-
-	ret = dispatch_queue(display, queue);
-
-	pthread_mutex_unlock(&display->mutex);
-
-	return ret;
+	return dispatch_queue(display, queue);
 }
 
 /** Process incoming events
@@ -1819,25 +2990,437 @@ wl_display_flush(struct wl_display *display)
 	int ret;
 
 	pthread_mutex_lock(&display->mutex);
+	ret = display_flush_locked(display);
+	pthread_mutex_unlock(&display->mutex);
 
-	if (display->last_error) {
-		errno = display->last_error;
-		ret = -1;
-	} else {
-		/* We don't make EPIPE a fatal error here, so that we may try to
-		 * read events after the failed flush. When the compositor sends
-		 * an error it will close the socket, and if we make EPIPE fatal
-		 * here we don't get a chance to process the error. */
-		ret = wl_connection_flush(display->connection);
-		if (ret < 0 && errno != EAGAIN && errno != EPIPE)
-			display_fatal_error(display, errno);
-	}
+	return ret;
+}
+
+/** Hold back automatic flushes
+ *
+ * \param display The display context object
+ *
+ * Until the matching wl_display_uncork(), requests are only buffered:
+ * the flush policy set with wl_display_set_flush_policy() does not send
+ * anything, so that all requests making up a frame (attach, damage,
+ * frame and commit, across subsurfaces) can go out in a single write.
+ * Calls nest.
+ *
+ * Explicit flushes, the flush done by the blocking dispatch functions
+ * and the flush forced when the 4 KiB out buffer fills up still happen
+ * while corked.
+ *
+ * \sa wl_display_uncork()
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT void
+wl_display_cork(struct wl_display *display)
+{
+	pthread_mutex_lock(&display->mutex);
+	display->cork_count++;
+	pthread_mutex_unlock(&display->mutex);
+}
+
+/** Send requests held back by wl_display_cork()
+ *
+ * \param display The display context object
+ * \return The number of bytes sent, 0 while an outer cork is still in
+ * place, or -1 on failure with errno set
+ *
+ * Undo one wl_display_cork(). When the last cork is removed, the
+ * buffered requests are flushed like with wl_display_flush(). If the
+ * socket is full, -1 is returned with errno set to EAGAIN and the
+ * requests stay buffered until the next flush.
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT int
+wl_display_uncork(struct wl_display *display)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&display->mutex);
+
+	if (display->cork_count > 0 && --display->cork_count == 0)
+		ret = display_flush_locked(display);
 
 	pthread_mutex_unlock(&display->mutex);
 
 	return ret;
 }
 
+/** Set when the library flushes requests on its own
+ *
+ * \param display The display context object
+ * \param flags A bitmask of wl_display_flush_flags
+ * \param max_bytes Buffered bytes that trigger a flush, used with
+ * WL_DISPLAY_FLUSH_BYTES
+ * \param max_messages Requests since the last flush that trigger a flush,
+ * used with WL_DISPLAY_FLUSH_MESSAGES
+ *
+ * By default requests are only sent by wl_display_flush(), by the
+ * blocking dispatch functions, or when the out buffer is full. This adds
+ * flushes after a request once \c max_bytes are buffered or
+ * \c max_messages requests were issued, and with
+ * WL_DISPLAY_FLUSH_BEFORE_READ in wl_display_prepare_read_queue() and in
+ * the library reader thread before it waits for events.
+ *
+ * These flushes never fail: if the socket is full, the data stays
+ * buffered for the next flush. They are suspended while the display is
+ * corked. Passing 0 as \c flags restores the default.
+ *
+ * \sa wl_display_cork()
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT void
+wl_display_set_flush_policy(struct wl_display *display, uint32_t flags,
+			    uint32_t max_bytes, uint32_t max_messages)
+{
+	pthread_mutex_lock(&display->mutex);
+	display->flush_flags = flags;
+	display->flush_bytes = max_bytes;
+	display->flush_messages = max_messages;
+	pthread_mutex_unlock(&display->mutex);
+}
+
+/** Get counters describing the traffic on a display
+ *
+ * \param display The display context object
+ * \param stats Filled in with the counters
+ *
+ * The counters accumulate over the lifetime of the display, so that
+ * sampling them periodically tells how much protocol traffic the client
+ * generates and how long it waits for the compositor.
+ *
+ * Bytes are counted as written to and read from the socket. Received
+ * messages include events discarded without being queued, such as those
+ * for destroyed objects or dropped by coalescing. The wait time covers
+ * the blocking dispatch functions, wl_display_read_events() waiting for
+ * other readers, and waiting for the library reader thread; time an
+ * application spends polling the display fd on its own is not included.
+ *
+ * \sa wl_event_queue_get_stats()
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT void
+wl_display_get_stats(struct wl_display *display,
+		     struct wl_display_stats *stats)
+{
+	struct wl_connection_stats connection_stats;
+
+	pthread_mutex_lock(&display->mutex);
+	wl_connection_get_stats(display->connection, &connection_stats);
+	stats->messages_sent = display->messages_sent;
+	stats->messages_received = display->messages_received;
+	pthread_mutex_unlock(&display->mutex);
+
+	stats->bytes_sent = connection_stats.bytes_out;
+	stats->bytes_received = connection_stats.bytes_in;
+	stats->flushes = connection_stats.flushes;
+	stats->flushes_eagain = connection_stats.flushes_eagain;
+	stats->read_wait_ns = __atomic_load_n(&display->read_wait_ns,
+					      __ATOMIC_RELAXED);
+}
+
+static void
+sync_future_done(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	struct wl_sync_future *future = data;
+
+	wl_callback_destroy(callback);
+	future->callback = NULL;
+	future->serial = serial;
+	__atomic_store_n(&future->done, 1, __ATOMIC_RELEASE);
+
+	if (future->func)
+		future->func(future->data, future);
+}
+
+static const struct wl_callback_listener sync_future_listener = {
+	sync_future_done
+};
+
+/** Issue a sync request without waiting for it
+ *
+ * \param display The display context object
+ * \param queue The queue the reply is dispatched on, or NULL for the
+ * default queue
+ * \return A new sync future, or NULL on failure
+ *
+ * Send a wl_display.sync request and return a handle that completes once
+ * the server has processed every request issued before it and the reply
+ * has been dispatched from \c queue. Unlike wl_display_roundtrip_queue(),
+ * this does not block, so several roundtrips can be outstanding at once
+ * and be resolved by the same read.
+ *
+ * The request is buffered like any other; wl_sync_future_wait() or the
+ * usual dispatch functions flush it. The reply is bound to \c queue before
+ * the request is sent, so it cannot be dispatched anywhere else.
+ *
+ * \sa wl_sync_future_wait(), wl_sync_future_set_callback()
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT struct wl_sync_future *
+wl_display_sync_future(struct wl_display *display,
+		       struct wl_event_queue *queue)
+{
+	struct wl_sync_future *future;
+	struct wl_proxy *callback;
+	union wl_argument args[1];
+
+	future = zalloc(sizeof *future);
+	if (future == NULL)
+		return NULL;
+
+	future->display = display;
+	future->queue = queue ? queue : &display->default_queue;
+
+	args[0].o = NULL;
+
+	pthread_mutex_lock(&display->mutex);
+	callback = proxy_marshal_array_locked(&display->proxy, WL_DISPLAY_SYNC,
+					      args, &wl_callback_interface,
+					      display->proxy.version);
+	if (callback) {
+		callback->queue = future->queue;
+		callback->object.implementation =
+			(void (**)(void)) &sync_future_listener;
+		callback->user_data = future;
+	}
+	pthread_mutex_unlock(&display->mutex);
+
+	if (callback == NULL) {
+		free(future);
+		return NULL;
+	}
+
+	future->callback = (struct wl_callback *) callback;
+
+	return future;
+}
+
+/** Run a function once a sync future completes
+ *
+ * \param future The sync future
+ * \param func The function to call, or NULL
+ * \param data User data passed to \c func
+ *
+ * \c func is called from the dispatch of the future's queue, right after
+ * the future is marked done. It may issue further requests, including
+ * new sync futures, which chains roundtrips without blocking. If the
+ * future is already done, \c func is not called.
+ *
+ * \memberof wl_sync_future
+ */
+WL_EXPORT void
+wl_sync_future_set_callback(struct wl_sync_future *future,
+			    wl_sync_future_func_t func, void *data)
+{
+	future->func = func;
+	future->data = data;
+}
+
+/** Check whether a sync future has completed
+ *
+ * \param future The sync future
+ * \return 1 if the reply has been dispatched, 0 otherwise
+ *
+ * This does not read or dispatch anything.
+ *
+ * \memberof wl_sync_future
+ */
+WL_EXPORT int
+wl_sync_future_is_done(struct wl_sync_future *future)
+{
+	return __atomic_load_n(&future->done, __ATOMIC_ACQUIRE);
+}
+
+/** Get the serial carried by the reply of a sync future
+ *
+ * \param future The sync future
+ * \return The serial of the wl_callback.done event, or 0 while the
+ * future has not completed
+ *
+ * \memberof wl_sync_future
+ */
+WL_EXPORT uint32_t
+wl_sync_future_get_serial(struct wl_sync_future *future)
+{
+	if (!wl_sync_future_is_done(future))
+		return 0;
+
+	return future->serial;
+}
+
+static int
+timeout_remaining(const struct timespec *deadline)
+{
+	struct timespec now;
+	int64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+/* Read once from the display fd for the future's queue, giving up after
+ * timeout milliseconds.  Returns 1 if something was read or dispatching
+ * should be retried, 0 on timeout and -1 on error. */
+static int
+sync_future_read(struct wl_display *display, struct wl_event_queue *queue,
+		 int timeout)
+{
+	struct pollfd pfd;
+	uint64_t start;
+	int ret;
+
+	if (wl_display_prepare_read_queue(display, queue) != 0)
+		return 1;
+
+	pfd.fd = display->fd;
+	pfd.events = POLLIN;
+
+	ret = wl_display_flush(display);
+	if (ret < 0 && errno == EAGAIN)
+		pfd.events |= POLLOUT;
+	else if (ret < 0 && errno != EPIPE) {
+		wl_display_cancel_read(display);
+		return -1;
+	}
+
+	start = monotonic_ns();
+	ret = poll(&pfd, 1, timeout);
+	display_add_read_wait(display, start);
+	if (ret <= 0 || !(pfd.revents & (POLLIN | POLLERR | POLLHUP))) {
+		wl_display_cancel_read(display);
+		if (ret == -1 && errno != EINTR)
+			return -1;
+		return ret == 0 ? 0 : 1;
+	}
+
+	if (wl_display_read_events(display) == -1)
+		return -1;
+
+	return 1;
+}
+
+/* Wait for the reader thread to queue something on the future's queue */
+static int
+sync_future_wait_read_thread(struct wl_display *display,
+			     struct wl_event_queue *queue, int timeout)
+{
+	struct pollfd pfd;
+	uint64_t start;
+	int ret;
+
+	ret = wl_display_flush(display);
+	if (ret < 0 && errno != EAGAIN && errno != EPIPE)
+		return -1;
+
+	pfd.fd = wl_event_queue_get_fd(queue);
+	if (pfd.fd < 0)
+		return -1;
+	pfd.events = POLLIN;
+
+	start = monotonic_ns();
+	ret = poll(&pfd, 1, timeout);
+	display_add_read_wait(display, start);
+	if (ret == -1 && errno != EINTR)
+		return -1;
+
+	return ret != 0;
+}
+
+/** Wait for a sync future to complete
+ *
+ * \param future The sync future
+ * \param timeout Maximum time to wait in milliseconds, or -1 to wait
+ * without a limit
+ * \return 1 if the future completed, 0 on timeout, or -1 on failure with
+ * errno set
+ *
+ * Flush the display, then read and dispatch the future's queue until
+ * the future completes or \c timeout expires. Other events on that queue
+ * are dispatched as well. When the library reader thread is running, the
+ * queue's fd is polled instead of reading from the display.
+ *
+ * Like wl_display_dispatch_queue(), this must not be called while the
+ * thread is prepared to read. When other threads are reading as well,
+ * the call may return later than \c timeout.
+ *
+ * \memberof wl_sync_future
+ */
+WL_EXPORT int
+wl_sync_future_wait(struct wl_sync_future *future, int timeout)
+{
+	struct wl_display *display = future->display;
+	struct wl_event_queue *queue = future->queue;
+	struct timespec deadline;
+	int threaded, ret, remaining = timeout;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	while (!wl_sync_future_is_done(future)) {
+		if (wl_display_dispatch_queue_pending(display, queue) < 0)
+			return -1;
+		if (wl_sync_future_is_done(future))
+			break;
+
+		if (timeout > 0)
+			remaining = timeout_remaining(&deadline);
+		if (timeout >= 0 && remaining == 0)
+			return 0;
+
+		pthread_mutex_lock(&display->mutex);
+		threaded = display->read_thread_running;
+		pthread_mutex_unlock(&display->mutex);
+
+		if (threaded)
+			ret = sync_future_wait_read_thread(display, queue,
+							   remaining);
+		else
+			ret = sync_future_read(display, queue, remaining);
+
+		if (ret < 0)
+			return -1;
+	}
+
+	return 1;
+}
+
+/** Destroy a sync future
+ *
+ * \param future The sync future
+ *
+ * Free the future. If it has not completed yet, its reply is discarded
+ * when it arrives and the callback set with wl_sync_future_set_callback()
+ * is not called.
+ *
+ * \memberof wl_sync_future
+ */
+WL_EXPORT void
+wl_sync_future_destroy(struct wl_sync_future *future)
+{
+	if (future->callback)
+		wl_callback_destroy(future->callback);
+
+	free(future);
+}
+
 /** Set the user data associated with a proxy
  *
  * \param proxy The proxy object
@@ -1933,10 +3516,16 @@ wl_proxy_get_class(struct wl_proxy *proxy)
 WL_EXPORT void
 wl_proxy_set_queue(struct wl_proxy *proxy, struct wl_event_queue *queue)
 {
+	struct wl_display *display = proxy->display;
+
+	pthread_mutex_lock(&display->mutex);
+
 	if (queue)
 		proxy->queue = queue;
 	else
-		proxy->queue = &proxy->display->default_queue;
+		proxy->queue = &display->default_queue;
+
+	pthread_mutex_unlock(&display->mutex);
 }
 
 WL_EXPORT void
@@ -36,6 +36,7 @@
 #include "wayland-util.h"
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+#define DIV_ROUNDUP(n, a) ( ((n) + ((a) - 1)) / (a) )
 
 #define container_of(ptr, type, member) ({				\
 	const __typeof__( ((type *)0)->member ) *__mptr = (ptr);	\
@@ -103,6 +104,15 @@ struct wl_connection;
 struct wl_closure;
 struct wl_proxy;
 
+/* Counters kept by a connection over its lifetime */
+struct wl_connection_stats {
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	/* flushes with data to send, and those that hit EAGAIN */
+	uint64_t flushes;
+	uint64_t flushes_eagain;
+};
+
 int
 wl_interface_equal(const struct wl_interface *iface1,
 		   const struct wl_interface *iface2);
@@ -125,6 +135,17 @@ wl_connection_flush(struct wl_connection *connection);
 uint32_t
 wl_connection_pending_input(struct wl_connection *connection);
 
+uint32_t
+wl_connection_pending_output(struct wl_connection *connection);
+
+void
+wl_connection_get_stats(struct wl_connection *connection,
+			struct wl_connection_stats *stats);
+
+void
+wl_connection_set_queue_when_full(struct wl_connection *connection,
+				  int queue);
+
 int
 wl_connection_read(struct wl_connection *connection);
 
@@ -139,14 +160,24 @@ wl_connection_queue(struct wl_connection *connection,
 int
 wl_connection_get_fd(struct wl_connection *connection);
 
+int
+wl_connection_export(struct wl_connection *connection,
+		     struct wl_array *state, struct wl_array *fds);
+
+const uint32_t *
+wl_connection_import(struct wl_connection *connection,
+		     const uint32_t *p, const uint32_t *end,
+		     const int *fds, int nfds);
+
 struct wl_closure {
 	int count;
 	const struct wl_message *message;
 	uint32_t opcode;
 	uint32_t sender_id;
-	union wl_argument args[WL_CLOSURE_MAX_ARGS];
+	union wl_argument *args;
 	struct wl_list link;
 	struct wl_proxy *proxy;
+	size_t alloc;
 	struct wl_array extra[0];
 };
 
@@ -213,16 +244,40 @@ wl_closure_print(struct wl_closure *closure,
 void
 wl_closure_destroy(struct wl_closure *closure);
 
+void
+wl_closure_recycle(struct wl_closure *closure,
+		   struct wl_connection *connection);
+
 extern wl_log_func_t wl_log_handler;
 
 void wl_log(const char *fmt, ...);
 void wl_abort(const char *fmt, ...);
 
 struct wl_display;
+struct wl_client;
 
 struct wl_array *
 wl_display_get_additional_shm_formats(struct wl_display *display);
 
+int
+wl_client_charge(struct wl_client *client, uint32_t limit, size_t amount);
+
+void
+wl_client_uncharge(struct wl_client *client, uint32_t limit, size_t amount);
+
+struct wl_event_source;
+
+void
+wl_event_source_defer(struct wl_event_source *source, uint32_t mask);
+
+struct wl_resource;
+
+int
+wl_shm_resource_is_mapping(struct wl_resource *resource);
+
+int
+wl_shm_restore(struct wl_client *client, uint32_t version, uint32_t id);
+
 static inline void *
 zalloc(size_t s)
 {
@@ -39,7 +39,13 @@ enum {
 	WL_EVENT_READABLE = 0x01,
 	WL_EVENT_WRITABLE = 0x02,
 	WL_EVENT_HANGUP   = 0x04,
-	WL_EVENT_ERROR    = 0x08
+	WL_EVENT_ERROR    = 0x08,
+	WL_EVENT_EDGE_TRIGGERED = 0x10
+};
+
+enum {
+	WL_EVENT_PRIORITY_NORMAL = 0,
+	WL_EVENT_PRIORITY_HIGH   = 1
 };
 
 struct wl_event_loop;
@@ -48,6 +54,7 @@ typedef int (*wl_event_loop_fd_func_t)(int fd, uint32_t mask, void *data);
 typedef int (*wl_event_loop_timer_func_t)(void *data);
 typedef int (*wl_event_loop_signal_func_t)(int signal_number, void *data);
 typedef void (*wl_event_loop_idle_func_t)(void *data);
+typedef void (*wl_event_loop_task_func_t)(void *data);
 
 struct wl_event_loop *
 wl_event_loop_create(void);
@@ -64,6 +71,9 @@ wl_event_loop_add_fd(struct wl_event_loop *loop,
 int
 wl_event_source_fd_update(struct wl_event_source *source, uint32_t mask);
 
+int
+wl_event_source_set_priority(struct wl_event_source *source, int priority);
+
 struct wl_event_source *
 wl_event_loop_add_timer(struct wl_event_loop *loop,
 			wl_event_loop_timer_func_t func,
@@ -100,6 +110,46 @@ wl_event_loop_add_idle(struct wl_event_loop *loop,
 int
 wl_event_loop_get_fd(struct wl_event_loop *loop);
 
+void
+wl_event_loop_set_busy_poll(struct wl_event_loop *loop, uint32_t budget_us);
+
+void
+wl_event_loop_get_busy_poll_stats(struct wl_event_loop *loop,
+				  uint64_t *spin_ns, uint64_t *sleep_ns);
+
+void
+wl_event_loop_set_profiling(struct wl_event_loop *loop, int enabled);
+
+void
+wl_event_loop_get_dispatch_stats(struct wl_event_loop *loop,
+				 uint64_t *wait_ns, uint64_t *idle_ns);
+
+void
+wl_event_source_get_dispatch_stats(struct wl_event_source *source,
+				   uint64_t *count,
+				   uint64_t *total_ns, uint64_t *max_ns);
+
+struct timespec;
+
+void
+wl_event_loop_set_deadline(struct wl_event_loop *loop,
+			   const struct timespec *deadline,
+			   uint32_t margin_us);
+
+int
+wl_event_loop_deadline_reached(struct wl_event_loop *loop);
+
+int
+wl_event_loop_set_batch_limit(struct wl_event_loop *loop, int limit);
+
+int
+wl_event_loop_post(struct wl_event_loop *loop,
+		   wl_event_loop_task_func_t func, void *data);
+
+int
+wl_event_loop_run_sync(struct wl_event_loop *loop,
+		       wl_event_loop_task_func_t func, void *data);
+
 struct wl_client;
 struct wl_display;
 struct wl_listener;
@@ -199,6 +249,54 @@ wl_client_get_object(struct wl_client *client, uint32_t id);
 void
 wl_client_post_no_memory(struct wl_client *client);
 
+/** Per-client resources that can be accounted and limited
+ *
+ * \sa wl_client_set_limit(), wl_display_set_client_limit()
+ */
+enum wl_client_limit {
+	/** Number of protocol objects (wl_resource) owned by the client */
+	WL_CLIENT_LIMIT_OBJECTS = 0,
+	/** Bytes of server-side memory allocated on behalf of the client */
+	WL_CLIENT_LIMIT_MEMORY = 1,
+	/** Bytes of client shared memory mapped by the server */
+	WL_CLIENT_LIMIT_SHM = 2
+};
+
+typedef void (*wl_client_limit_func_t)(struct wl_client *client,
+				       enum wl_client_limit limit,
+				       void *data);
+
+int
+wl_display_set_client_limit(struct wl_display *display,
+			    enum wl_client_limit limit, size_t value);
+
+void
+wl_display_set_client_limit_handler(struct wl_display *display,
+				    wl_client_limit_func_t handler,
+				    void *data);
+
+int
+wl_client_set_limit(struct wl_client *client,
+		    enum wl_client_limit limit, size_t value);
+
+size_t
+wl_client_get_usage(struct wl_client *client, enum wl_client_limit limit);
+
+typedef int (*wl_client_import_func_t)(struct wl_client *client,
+				       const char *interface,
+				       uint32_t version, uint32_t id,
+				       void *data);
+
+int
+wl_client_export(struct wl_client *client,
+		 struct wl_array *state, struct wl_array *fds);
+
+struct wl_client *
+wl_client_import(struct wl_display *display,
+		 const void *state, size_t size,
+		 const int *fds, int nfds,
+		 wl_client_import_func_t func, void *data);
+
 /** \class wl_listener
  *
  * \brief A single listener for Wayland signals
@@ -330,6 +428,47 @@ wl_signal_emit(struct wl_signal *signal, void *data)
 		l->notify(l, data);
 }
 
+struct wl_idle_task;
+typedef void (*wl_idle_task_func_t)(struct wl_idle_task *task);
+
+/** \class wl_idle_task
+ *
+ * \brief Work deferred until the event loop goes idle
+ *
+ * Unlike wl_event_loop_add_idle(), which allocates a new event source
+ * every time, a wl_idle_task is embedded in the caller's own struct
+ * and can be scheduled and cancelled any number of times without
+ * allocating.  Scheduling a task that is already scheduled does
+ * nothing, so it is cheap to do from hot paths, e.g. once per damage
+ * report to trigger a single repaint.
+ *
+ * \code
+ * wl_idle_task_init(&output->repaint_task, repaint_output);
+ * ...
+ * wl_event_loop_schedule_idle_task(loop, &output->repaint_task);
+ * \endcode
+ *
+ * The task runs once from the next wl_event_loop_dispatch_idle(); use
+ * #wl_container_of in \c func to get to the surrounding struct.
+ */
+struct wl_idle_task {
+	struct wl_list link;
+	wl_idle_task_func_t func;
+};
+
+void
+wl_idle_task_init(struct wl_idle_task *task, wl_idle_task_func_t func);
+
+void
+wl_event_loop_schedule_idle_task(struct wl_event_loop *loop,
+				 struct wl_idle_task *task);
+
+void
+wl_idle_task_cancel(struct wl_idle_task *task);
+
+int
+wl_idle_task_is_scheduled(struct wl_idle_task *task);
+
 typedef void (*wl_resource_destroy_func_t)(struct wl_resource *resource);
 
 /*
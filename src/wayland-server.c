@@ -59,6 +59,19 @@
 #define LOCK_SUFFIX	".lock"
 #define LOCK_SUFFIXLEN	5
 
+#define WL_CLIENT_LIMIT_COUNT	(WL_CLIENT_LIMIT_SHM + 1)
+
+/* Maximum number of connections accepted per wakeup of a listening
+ * socket.  Whatever is left in the backlog is picked up on the next
+ * dispatch, so a connection storm can't starve the other sources. */
+#define MAX_ACCEPT_BATCH	64
+
+/* Maximum number of requests dispatched per wakeup of a client socket.
+ * The socket is edge-triggered, so the rest is put on the loop's
+ * deferred list and handled on the next dispatch, which keeps a client
+ * flooding requests from starving the other sources. */
+#define MAX_REQUEST_BATCH	256
+
 struct wl_socket {
 	int fd;
 	int fd_lock;
@@ -81,6 +94,8 @@ struct wl_client {
 	struct wl_signal destroy_signal;
 	struct ucred ucred;
 	int error;
+	size_t usage[WL_CLIENT_LIMIT_COUNT];
+	size_t limits[WL_CLIENT_LIMIT_COUNT];
 };
 
 struct wl_display {
@@ -98,6 +113,10 @@ struct wl_display {
 	struct wl_signal destroy_signal;
 
 	struct wl_array additional_shm_formats;
+
+	size_t client_limits[WL_CLIENT_LIMIT_COUNT];
+	wl_client_limit_func_t limit_handler;
+	void *limit_handler_data;
 };
 
 struct wl_global {
@@ -242,111 +261,136 @@ wl_client_connection_data(int fd, uint32_t mask, void *data)
 	uint32_t p[2];
 	uint32_t resource_flags;
 	int opcode, size, since;
-	int len;
+	int len, count = 0;
 
 	if (mask & (WL_EVENT_ERROR | WL_EVENT_HANGUP)) {
 		wl_client_destroy(client);
 		return 1;
 	}
 
-	if (mask & WL_EVENT_WRITABLE) {
+	/* The socket stays registered for writable events, so the
+	 * interest mask never has to change. Edge-triggered, they come
+	 * whenever the client drains its socket; most find nothing left
+	 * to flush. */
+	if ((mask & WL_EVENT_WRITABLE) &&
+	    wl_connection_pending_output(connection) > 0) {
 		len = wl_connection_flush(connection);
 		if (len < 0 && errno != EAGAIN) {
 			wl_client_destroy(client);
 			return 1;
-		} else if (len >= 0) {
-			wl_event_source_fd_update(client->source,
-						  WL_EVENT_READABLE);
-		}
-	}
-
-	len = 0;
-	if (mask & WL_EVENT_READABLE) {
-		len = wl_connection_read(connection);
-		if (len == 0 || (len < 0 && errno != EAGAIN)) {
-			wl_client_destroy(client);
-			return 1;
 		}
 	}
 
-	while ((size_t) len >= sizeof p) {
-		wl_connection_copy(connection, p, sizeof p);
-		opcode = p[1] & 0xffff;
-		size = p[1] >> 16;
-		if (len < size)
-			break;
-
-		resource = wl_map_lookup(&client->objects, p[0]);
-		resource_flags = wl_map_lookup_flags(&client->objects, p[0]);
-		if (resource == NULL) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_OBJECT,
-					       "invalid object %u", p[0]);
-			break;
-		}
+	/* Without a readable edge there is nothing new to read, and a
+	 * backlog left for later is on the loop's deferred list. */
+	if (!(mask & WL_EVENT_READABLE))
+		return 1;
 
-		object = &resource->object;
-		if (opcode >= object->interface->method_count) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_METHOD,
-					       "invalid method %d, object %s@%u",
-					       opcode,
-					       object->interface->name,
-					       object->id);
-			break;
+	/* The socket is edge-triggered, so we only hear about it again
+	 * once reading has hit EAGAIN, or once deferred work is due. */
+
+	len = wl_connection_pending_input(connection);
+	for (;;) {
+		while ((size_t) len >= sizeof p) {
+			wl_connection_copy(connection, p, sizeof p);
+			opcode = p[1] & 0xffff;
+			size = p[1] >> 16;
+			if (len < size)
+				break;
+
+			resource = wl_map_lookup(&client->objects, p[0]);
+			resource_flags = wl_map_lookup_flags(&client->objects, p[0]);
+			if (resource == NULL) {
+				wl_resource_post_error(client->display_resource,
+						       WL_DISPLAY_ERROR_INVALID_OBJECT,
+						       "invalid object %u", p[0]);
+				break;
+			}
+
+			object = &resource->object;
+			if (opcode >= object->interface->method_count) {
+				wl_resource_post_error(client->display_resource,
+						       WL_DISPLAY_ERROR_INVALID_METHOD,
+						       "invalid method %d, object %s@%u",
+						       opcode,
+						       object->interface->name,
+						       object->id);
+				break;
+			}
+
+			message = &object->interface->methods[opcode];
+			since = wl_message_get_since(message);
+			if (!(resource_flags & WL_MAP_ENTRY_LEGACY) &&
+			    resource->version > 0 && resource->version < since) {
+				wl_resource_post_error(client->display_resource,
+						       WL_DISPLAY_ERROR_INVALID_METHOD,
+						       "invalid method %d (since %d < %d)"
+						       ", object %s@%u",
+						       opcode, resource->version, since,
+						       object->interface->name,
+						       object->id);
+				break;
+			}
+
+			closure = wl_connection_demarshal(client->connection, size,
+							  &client->objects, message);
+
+			if (closure == NULL && errno == ENOMEM) {
+				wl_resource_post_no_memory(resource);
+				break;
+			} else if (closure == NULL ||
+				   wl_closure_lookup_objects(closure, &client->objects) < 0) {
+				wl_resource_post_error(client->display_resource,
+						       WL_DISPLAY_ERROR_INVALID_METHOD,
+						       "invalid arguments for %s@%u.%s",
+						       object->interface->name,
+						       object->id,
+						       message->name);
+				wl_closure_destroy(closure);
+				break;
+			}
+
+			if (debug_server)
+				wl_closure_print(closure, object, false);
+
+			if ((resource_flags & WL_MAP_ENTRY_LEGACY) ||
+			    resource->dispatcher == NULL) {
+				wl_closure_invoke(closure, WL_CLOSURE_INVOKE_SERVER,
+						  object, opcode, client);
+			} else {
+				wl_closure_dispatch(closure, resource->dispatcher,
+						    object, opcode);
+			}
+
+			wl_closure_recycle(closure, connection);
+
+			if (client->error)
+				break;
+
+			len = wl_connection_pending_input(connection);
+
+			/* Leave the rest of the backlog for after the
+			 * repaint, or for the next dispatch once this
+			 * wakeup has used up its batch; the loop calls us
+			 * again then. */
+			if (++count >= MAX_REQUEST_BATCH ||
+			    wl_event_loop_deadline_reached(client->display->loop)) {
+				wl_event_source_defer(client->source,
+						      WL_EVENT_READABLE);
+				return 1;
+			}
 		}
 
-		message = &object->interface->methods[opcode];
-		since = wl_message_get_since(message);
-		if (!(resource_flags & WL_MAP_ENTRY_LEGACY) &&
-		    resource->version > 0 && resource->version < since) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_METHOD,
-					       "invalid method %d (since %d < %d)"
-					       ", object %s@%u",
-					       opcode, resource->version, since,
-					       object->interface->name,
-					       object->id);
+		if (client->error || !(mask & WL_EVENT_READABLE))
 			break;
-		}
-
 
-		closure = wl_connection_demarshal(client->connection, size,
-						  &client->objects, message);
-
-		if (closure == NULL && errno == ENOMEM) {
-			wl_resource_post_no_memory(resource);
-			break;
-		} else if (closure == NULL ||
-			   wl_closure_lookup_objects(closure, &client->objects) < 0) {
-			wl_resource_post_error(client->display_resource,
-					       WL_DISPLAY_ERROR_INVALID_METHOD,
-					       "invalid arguments for %s@%u.%s",
-					       object->interface->name,
-					       object->id,
-					       message->name);
-			wl_closure_destroy(closure);
+		len = wl_connection_read(connection);
+		if (len < 0 && errno == EAGAIN)
 			break;
+		if (len <= 0) {
+			wl_client_destroy(client);
+			return 1;
 		}
-
-		if (debug_server)
-			wl_closure_print(closure, object, false);
-
-		if ((resource_flags & WL_MAP_ENTRY_LEGACY) ||
-		    resource->dispatcher == NULL) {
-			wl_closure_invoke(closure, WL_CLOSURE_INVOKE_SERVER,
-					  object, opcode, client);
-		} else {
-			wl_closure_dispatch(closure, resource->dispatcher,
-					    object, opcode);
-		}
-
-		wl_closure_destroy(closure);
-
-		if (client->error)
-			break;
-
-		len = wl_connection_pending_input(connection);
 	}
 
 	if (client->error)
@@ -421,8 +465,11 @@ wl_client_create(struct wl_display *display, int fd)
 		return NULL;
 
 	client->display = display;
+	memcpy(client->limits, display->client_limits, sizeof client->limits);
 	client->source = wl_event_loop_add_fd(display->loop, fd,
-					      WL_EVENT_READABLE,
+					      WL_EVENT_READABLE |
+					      WL_EVENT_WRITABLE |
+					      WL_EVENT_EDGE_TRIGGERED,
 					      wl_client_connection_data, client);
 
 	if (!client->source)
@@ -557,6 +604,119 @@ wl_resource_post_no_memory(struct wl_resource *resource)
 			       WL_DISPLAY_ERROR_NO_MEMORY, "no memory");
 }
 
+/** Account a resource allocation to a client
+ *
+ * \param client The client object
+ * \param limit The kind of resource, from enum wl_client_limit
+ * \param amount How much of the resource is being allocated
+ * \return 0 on success, -1 with errno set to ENOMEM if the allocation
+ * would take the client over its limit
+ *
+ * When the limit is exceeded, the usage is left unchanged and the limit
+ * handler set with wl_display_set_client_limit_handler() is called.
+ * Posting an error to the client is left to the caller.
+ */
+int
+wl_client_charge(struct wl_client *client, uint32_t limit, size_t amount)
+{
+	struct wl_display *display = client->display;
+
+	if (client->limits[limit] &&
+	    client->usage[limit] + amount > client->limits[limit]) {
+		if (display->limit_handler)
+			display->limit_handler(client, limit,
+					       display->limit_handler_data);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	client->usage[limit] += amount;
+
+	return 0;
+}
+
+void
+wl_client_uncharge(struct wl_client *client, uint32_t limit, size_t amount)
+{
+	client->usage[limit] -= amount;
+}
+
+/** Set a resource limit for a client
+ *
+ * \param client The client object
+ * \param limit The kind of resource to limit
+ * \param value The new limit, or 0 for no limit
+ * \return 0 on success, -1 with errno set to EINVAL if \c limit is not
+ * a wl_client_limit value
+ *
+ * Once a client reaches one of its limits, further allocations of that
+ * kind fail: creating a wl_resource returns NULL and creating or growing
+ * a wl_shm_pool posts a no_memory error.  Lowering a limit below the
+ * current usage does not release anything, it only prevents new
+ * allocations.
+ *
+ * \sa wl_display_set_client_limit()
+ *
+ * \memberof wl_client
+ */
+WL_EXPORT int
+wl_client_set_limit(struct wl_client *client,
+		    enum wl_client_limit limit, size_t value)
+{
+	if ((uint32_t) limit >= WL_CLIENT_LIMIT_COUNT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	client->limits[limit] = value;
+
+	return 0;
+}
+
+/** Get the current resource usage of a client
+ *
+ * \param client The client object
+ * \param limit The kind of resource to query
+ * \return The number of objects or bytes currently accounted to the
+ * client, or (size_t) -1 with errno set to EINVAL if \c limit is not a
+ * wl_client_limit value
+ *
+ * \memberof wl_client
+ */
+WL_EXPORT size_t
+wl_client_get_usage(struct wl_client *client, enum wl_client_limit limit)
+{
+	if ((uint32_t) limit >= WL_CLIENT_LIMIT_COUNT) {
+		errno = EINVAL;
+		return (size_t) -1;
+	}
+
+	return client->usage[limit];
+}
+
+static int
+resource_charge(struct wl_client *client)
+{
+	if (wl_client_charge(client, WL_CLIENT_LIMIT_OBJECTS, 1) < 0)
+		return -1;
+
+	if (wl_client_charge(client, WL_CLIENT_LIMIT_MEMORY,
+			     sizeof(struct wl_resource)) < 0) {
+		wl_client_uncharge(client, WL_CLIENT_LIMIT_OBJECTS, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+resource_uncharge(struct wl_client *client)
+{
+	wl_client_uncharge(client, WL_CLIENT_LIMIT_OBJECTS, 1);
+	wl_client_uncharge(client, WL_CLIENT_LIMIT_MEMORY,
+			   sizeof(struct wl_resource));
+}
+
 static void
 destroy_resource(void *element, void *data)
 {
@@ -570,8 +730,10 @@ destroy_resource(void *element, void *data)
 	if (resource->destroy)
 		resource->destroy(resource);
 
-	if (!(flags & WL_MAP_ENTRY_LEGACY))
+	if (!(flags & WL_MAP_ENTRY_LEGACY)) {
+		resource_uncharge(client);
 		free(resource);
+	}
 }
 
 WL_EXPORT void
@@ -830,6 +992,247 @@ bind_display(struct wl_client *client, struct wl_display *display)
 	return 0;
 }
 
+#define HANDOFF_MAGIC	0x4f484c57	/* "WLHO" */
+#define HANDOFF_VERSION	1
+
+struct export_data {
+	struct wl_array *state;
+	uint32_t count;
+	int error;
+};
+
+static void
+check_exportable(void *element, void *data)
+{
+	struct wl_resource *resource = element;
+	struct export_data *export = data;
+
+	if (wl_shm_resource_is_mapping(resource))
+		export->error = EOPNOTSUPP;
+	export->count++;
+}
+
+static void
+export_resource(void *element, void *data)
+{
+	struct wl_resource *resource = element;
+	struct export_data *export = data;
+	const char *name = resource->object.interface->name;
+	uint32_t *p, length;
+
+	if (export->error)
+		return;
+
+	length = strlen(name) + 1;
+	p = wl_array_add(export->state,
+			 (3 + DIV_ROUNDUP(length, sizeof *p)) * sizeof *p);
+	if (p == NULL) {
+		export->error = ENOMEM;
+		return;
+	}
+
+	p[0] = resource->object.id;
+	p[1] = resource->version;
+	p[2] = length;
+	memset(p + 3, 0, DIV_ROUNDUP(length, sizeof *p) * sizeof *p);
+	memcpy(p + 3, name, length);
+}
+
+/** Hand a client over to another process
+ *
+ * \param client The client object
+ * \param state Array the client's state is appended to
+ * \param fds Array of ints the client's file descriptors are appended to
+ * \return 0 on success, -1 on failure
+ *
+ * Serializes everything needed to continue serving \c client from a
+ * different wl_display, typically one in a new compositor process
+ * taking over after a restart: the client's socket, any requests and
+ * events buffered but not yet processed or sent, the file descriptors
+ * that came with them, and the id, version and interface of every
+ * object the client owns.  The client is then destroyed without
+ * flushing or closing its socket, so the peer notices nothing;
+ * destroy listeners and resource destructors run as usual to let the
+ * compositor release its own state.
+ *
+ * On success the caller owns the file descriptors appended to \c fds
+ * and is responsible for passing them, along with \c state, to the
+ * process that calls wl_client_import(), for example with SCM_RIGHTS.
+ *
+ * Objects backed by wl_shm pools cannot be exported, since the pool's
+ * file descriptor is closed once it is mapped.  If the client has any,
+ * this function fails with errno set to EOPNOTSUPP and the client is
+ * left untouched.
+ *
+ * \sa wl_client_import()
+ *
+ * \memberof wl_client
+ */
+WL_EXPORT int
+wl_client_export(struct wl_client *client,
+		 struct wl_array *state, struct wl_array *fds)
+{
+	struct export_data export = { state, 0, 0 };
+	size_t state_size = state->size;
+	uint32_t *p;
+
+	wl_map_for_each(&client->objects, check_exportable, &export);
+	if (export.error) {
+		errno = export.error;
+		return -1;
+	}
+
+	/* wl_map entries are one word each; preserve the extent of both
+	 * id ranges so ids the client freed stay valid for reuse. */
+	p = wl_array_add(state, 5 * sizeof *p);
+	if (p == NULL)
+		return -1;
+
+	p[0] = HANDOFF_MAGIC;
+	p[1] = HANDOFF_VERSION;
+	p[2] = client->objects.client_entries.size / sizeof(void *);
+	p[3] = client->objects.server_entries.size / sizeof(void *);
+	p[4] = export.count;
+
+	wl_map_for_each(&client->objects, export_resource, &export);
+	if (export.error ||
+	    wl_connection_export(client->connection, state, fds) < 0) {
+		state->size = state_size;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	wl_client_destroy(client);
+
+	return 0;
+}
+
+static int
+import_resource(struct wl_client *client, const char *interface,
+		uint32_t version, uint32_t id,
+		wl_client_import_func_t func, void *data)
+{
+	struct wl_display *display = client->display;
+	struct wl_resource *resource;
+
+	if (id == 1 && strcmp(interface, "wl_display") == 0)
+		return 0;
+
+	if (strcmp(interface, "wl_registry") == 0) {
+		resource = wl_resource_create(client, &wl_registry_interface,
+					      version, id);
+		if (resource == NULL)
+			return -1;
+
+		wl_resource_set_implementation(resource,
+					       &registry_interface,
+					       display, unbind_resource);
+		wl_list_insert(&display->registry_resource_list,
+			       &resource->link);
+		return 0;
+	}
+
+	if (strcmp(interface, "wl_shm") == 0)
+		return wl_shm_restore(client, version, id);
+
+	return func(client, interface, version, id, data);
+}
+
+/** Take over a client exported by another process
+ *
+ * \param display The display object
+ * \param state The state produced by wl_client_export()
+ * \param size The size of \c state in bytes
+ * \param fds The file descriptors produced by wl_client_export()
+ * \param nfds The number of entries in \c fds
+ * \param func Called to recreate each of the client's objects
+ * \param data User data passed to \c func
+ * \return The new client object or NULL on failure.
+ *
+ * Creates a client on the socket exported by wl_client_export() and
+ * restores its object map and buffered data.  wl_display, wl_registry
+ * and wl_shm objects are recreated by the library.  For every other
+ * object \c func is called, in increasing id order, and must create a
+ * wl_resource with exactly the given interface, version and id and set
+ * its implementation; it returns 0 on success or -1 to abort the
+ * import.  No events are sent for the recreated objects: the client
+ * already received them from the previous owner.
+ *
+ * Registry objects keep referring to globals by name, so the new
+ * display must create its globals in the same order as the old one.
+ * Objects that only exist for the duration of a request, such as
+ * wl_callback, may simply be skipped by \c func.
+ *
+ * The function takes ownership of \c fds: on success they belong to
+ * the new client, on failure they are closed.
+ *
+ * \sa wl_client_export()
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT struct wl_client *
+wl_client_import(struct wl_display *display,
+		 const void *state, size_t size,
+		 const int *fds, int nfds,
+		 wl_client_import_func_t func, void *data)
+{
+	struct wl_client *client;
+	const uint32_t *p = state, *end = p + size / sizeof *p;
+	uint32_t i, count, id, version, length;
+	const char *interface;
+
+	if (nfds < 1 || p + 5 > end ||
+	    p[0] != HANDOFF_MAGIC || p[1] != HANDOFF_VERSION)
+		goto err_fds;
+
+	client = wl_client_create(display, fds[0]);
+	if (client == NULL)
+		goto err_fds;
+
+	for (i = 2; i < p[2]; i++)
+		if (wl_map_insert_at(&client->objects, 0, i, NULL) < 0)
+			goto err_client;
+	for (i = 0; i < p[3]; i++)
+		if (wl_map_insert_at(&client->objects, 0,
+				     WL_SERVER_ID_START + i, NULL) < 0)
+			goto err_client;
+
+	count = p[4];
+	p += 5;
+	for (i = 0; i < count; i++) {
+		if (p + 3 > end)
+			goto err_client;
+
+		id = p[0];
+		version = p[1];
+		length = p[2];
+		interface = (const char *) (p + 3);
+		p += 3 + DIV_ROUNDUP(length, sizeof *p);
+		if (length == 0 || p > end || interface[length - 1] != '\0')
+			goto err_client;
+
+		if (import_resource(client, interface,
+				    version, id, func, data) < 0)
+			goto err_client;
+	}
+
+	if (wl_connection_import(client->connection, p, end,
+				 fds + 1, nfds - 1) == NULL)
+		goto err_client;
+
+	return client;
+
+err_client:
+	wl_client_destroy(client);
+	fds++;
+	nfds--;
+err_fds:
+	for (i = 0; i < (uint32_t) nfds; i++)
+		close(fds[i]);
+	errno = EINVAL;
+	return NULL;
+}
+
 /** Create Wayland display object.
  *
  * \return The Wayland display object. Null if failed to create
@@ -870,6 +1273,10 @@ wl_display_create(void)
 
 	wl_array_init(&display->additional_shm_formats);
 
+	memset(display->client_limits, 0, sizeof display->client_limits);
+	display->limit_handler = NULL;
+	display->limit_handler_data = NULL;
+
 	return display;
 }
 
@@ -1059,14 +1466,11 @@ wl_display_flush_clients(struct wl_display *display)
 	int ret;
 
 	wl_list_for_each_safe(client, next, &display->client_list, link) {
+		/* On EAGAIN the rest goes out when the edge-triggered
+		 * source reports the socket writable again. */
 		ret = wl_connection_flush(client->connection);
-		if (ret < 0 && errno == EAGAIN) {
-			wl_event_source_fd_update(client->source,
-						  WL_EVENT_WRITABLE |
-						  WL_EVENT_READABLE);
-		} else if (ret < 0) {
+		if (ret < 0 && errno != EAGAIN)
 			wl_client_destroy(client);
-		}
 	}
 }
 
@@ -1076,20 +1480,41 @@ socket_data(int fd, uint32_t mask, void *data)
 	struct wl_display *display = data;
 	struct sockaddr_un name;
 	socklen_t length;
-	int client_fd;
+	int client_fd, i;
+
+	/* The listening socket is non-blocking, so drain its backlog
+	 * instead of paying an epoll round-trip per connecting client. */
+	for (i = 0; i < MAX_ACCEPT_BATCH; i++) {
+		length = sizeof name;
+		client_fd = wl_os_accept_cloexec(fd, (struct sockaddr *) &name,
+						 &length);
+		if (client_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				wl_log("failed to accept: %m\n");
+			break;
+		}
 
-	length = sizeof name;
-	client_fd = wl_os_accept_cloexec(fd, (struct sockaddr *) &name,
-					 &length);
-	if (client_fd < 0)
-		wl_log("failed to accept: %m\n");
-	else
 		if (!wl_client_create(display, client_fd))
 			close(client_fd);
+	}
 
 	return 1;
 }
 
+static int
+set_nonblocking(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 static int
 wl_socket_lock(struct wl_socket *socket)
 {
@@ -1196,6 +1621,9 @@ _wl_display_add_socket(struct wl_display *display, struct wl_socket *s)
 		return -1;
 	}
 
+	if (set_nonblocking(s->fd) < 0)
+		return -1;
+
 	s->source = wl_event_loop_add_fd(display->loop, s->fd,
 					 WL_EVENT_READABLE,
 					 socket_data, display);
@@ -1254,7 +1682,9 @@ wl_display_add_socket_auto(struct wl_display *display)
  *
  * The existing socket fd must already be created, opened, and locked.
  * The fd must be properly set to CLOEXEC and bound to a socket file
- * with both bind() and listen() already called.
+ * with both bind() and listen() already called.  The fd is switched to
+ * non-blocking mode so that pending connections can be accepted in
+ * batches.
  *
  * \memberof wl_display
  */
@@ -1269,6 +1699,9 @@ wl_display_add_socket_fd(struct wl_display *display, int sock_fd)
 		return -1;
 	}
 
+	if (set_nonblocking(sock_fd) < 0)
+		return -1;
+
 	s = wl_socket_alloc();
 	if (s == NULL)
 		return -1;
@@ -1346,6 +1779,56 @@ wl_display_add_socket(struct wl_display *display, const char *name)
 	return 0;
 }
 
+/** Set the default resource limit for new clients
+ *
+ * \param display The display object
+ * \param limit The kind of resource to limit
+ * \param value The limit, or 0 for no limit
+ * \return 0 on success, -1 with errno set to EINVAL if \c limit is not
+ * a wl_client_limit value
+ *
+ * The limit applies to clients created after this call.  Use
+ * wl_client_set_limit() to change the limit of an existing client.
+ * By default clients are not limited.
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT int
+wl_display_set_client_limit(struct wl_display *display,
+			    enum wl_client_limit limit, size_t value)
+{
+	if ((uint32_t) limit >= WL_CLIENT_LIMIT_COUNT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	display->client_limits[limit] = value;
+
+	return 0;
+}
+
+/** Set the function called when a client hits one of its limits
+ *
+ * \param display The display object
+ * \param handler The function to call, or NULL
+ * \param data User data passed to \c handler
+ *
+ * The handler is called with the offending client before the allocation
+ * that would exceed the limit fails.  A compositor can use it to log the
+ * event or to disconnect the client.  The handler must not destroy the
+ * client; schedule that from an idle callback instead.
+ *
+ * \memberof wl_display
+ */
+WL_EXPORT void
+wl_display_set_client_limit_handler(struct wl_display *display,
+				    wl_client_limit_func_t handler,
+				    void *data)
+{
+	display->limit_handler = handler;
+	display->limit_handler_data = data;
+}
+
 WL_EXPORT void
 wl_display_add_destroy_listener(struct wl_display *display,
 				struct wl_listener *listener)
@@ -1390,9 +1873,14 @@ wl_resource_create(struct wl_client *client,
 {
 	struct wl_resource *resource;
 
+	if (resource_charge(client) < 0)
+		return NULL;
+
 	resource = malloc(sizeof *resource);
-	if (resource == NULL)
+	if (resource == NULL) {
+		resource_uncharge(client);
 		return NULL;
+	}
 
 	if (id == 0)
 		id = wl_map_insert_new(&client->objects, 0, NULL);
@@ -1413,6 +1901,7 @@ wl_resource_create(struct wl_client *client,
 		wl_resource_post_error(client->display_resource,
 				       WL_DISPLAY_ERROR_INVALID_OBJECT,
 				       "invalid new id %d", id);
+		resource_uncharge(client);
 		free(resource);
 		return NULL;
 	}
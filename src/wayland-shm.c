@@ -35,11 +35,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
 
+#include "../config.h"
 #include "wayland-private.h"
 #include "wayland-server.h"
 
@@ -48,6 +51,7 @@
  * wl_shm_buffer_begin_access which can happen from any thread */
 static pthread_once_t wl_shm_sigbus_once = PTHREAD_ONCE_INIT;
 static pthread_key_t wl_shm_sigbus_data_key;
+static bool wl_shm_sigbus_key_created;
 static struct sigaction wl_shm_old_sigbus_action;
 
 struct wl_shm_pool {
@@ -55,6 +59,12 @@ struct wl_shm_pool {
 	int refcount;
 	char *data;
 	int32_t size;
+	/* The client's file if it is sealed against shrinking, kept to
+	 * check again on resize whether it covers the mapping; -1 if not */
+	int fd;
+	/* The file covers the whole mapping, so accessing the pool
+	 * cannot raise SIGBUS */
+	bool sigbus_is_impossible;
 };
 
 struct wl_shm_buffer {
@@ -80,6 +90,8 @@ shm_pool_unref(struct wl_shm_pool *pool)
 		return;
 
 	munmap(pool->data, pool->size);
+	if (pool->fd >= 0)
+		close(pool->fd);
 	free(pool);
 }
 
@@ -88,6 +100,9 @@ destroy_buffer(struct wl_resource *resource)
 {
 	struct wl_shm_buffer *buffer = wl_resource_get_user_data(resource);
 
+	wl_client_uncharge(wl_resource_get_client(resource),
+			   WL_CLIENT_LIMIT_MEMORY, sizeof *buffer);
+
 	if (buffer->pool)
 		shm_pool_unref(buffer->pool);
 	free(buffer);
@@ -150,8 +165,16 @@ shm_pool_create_buffer(struct wl_client *client, struct wl_resource *resource,
 		return;
 	}
 
+	if (wl_client_charge(client, WL_CLIENT_LIMIT_MEMORY,
+			     sizeof *buffer) < 0) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
 	buffer = malloc(sizeof *buffer);
 	if (buffer == NULL) {
+		wl_client_uncharge(client, WL_CLIENT_LIMIT_MEMORY,
+				   sizeof *buffer);
 		wl_client_post_no_memory(client);
 		return;
 	}
@@ -167,6 +190,8 @@ shm_pool_create_buffer(struct wl_client *client, struct wl_resource *resource,
 	buffer->resource =
 		wl_resource_create(client, &wl_buffer_interface, 1, id);
 	if (buffer->resource == NULL) {
+		wl_client_uncharge(client, WL_CLIENT_LIMIT_MEMORY,
+				   sizeof *buffer);
 		wl_client_post_no_memory(client);
 		shm_pool_unref(pool);
 		free(buffer);
@@ -182,6 +207,12 @@ static void
 destroy_pool(struct wl_resource *resource)
 {
 	struct wl_shm_pool *pool = wl_resource_get_user_data(resource);
+	struct wl_client *client = wl_resource_get_client(resource);
+
+	/* The pool may outlive the resource through buffer or compositor
+	 * references, but it stops counting against the client here. */
+	wl_client_uncharge(client, WL_CLIENT_LIMIT_SHM, pool->size);
+	wl_client_uncharge(client, WL_CLIENT_LIMIT_MEMORY, sizeof *pool);
 
 	shm_pool_unref(pool);
 }
@@ -192,6 +223,33 @@ shm_pool_destroy(struct wl_client *client, struct wl_resource *resource)
 	wl_resource_destroy(resource);
 }
 
+/* Whether fd is a memfd that can never become shorter than it is now */
+static bool
+fd_is_sealed(int fd)
+{
+#ifdef HAVE_MEMFD_CREATE
+	int seals;
+
+	seals = fcntl(fd, F_GET_SEALS);
+
+	return seals != -1 && (seals & F_SEAL_SHRINK);
+#else
+	return false;
+#endif
+}
+
+/* Whether the file behind fd is at least size bytes long */
+static bool
+fd_covers(int fd, int32_t size)
+{
+	struct stat statbuf;
+
+	if (fstat(fd, &statbuf) < 0)
+		return false;
+
+	return statbuf.st_size >= size;
+}
+
 static void
 shm_pool_resize(struct wl_client *client, struct wl_resource *resource,
 		int32_t size)
@@ -206,8 +264,16 @@ shm_pool_resize(struct wl_client *client, struct wl_resource *resource,
 		return;
 	}
 
+	if (wl_client_charge(client, WL_CLIENT_LIMIT_SHM,
+			     size - pool->size) < 0) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
 	data = mremap(pool->data, pool->size, size, MREMAP_MAYMOVE);
 	if (data == MAP_FAILED) {
+		wl_client_uncharge(client, WL_CLIENT_LIMIT_SHM,
+				   size - pool->size);
 		wl_resource_post_error(resource,
 				       WL_SHM_ERROR_INVALID_FD,
 				       "failed mremap");
@@ -216,6 +282,12 @@ shm_pool_resize(struct wl_client *client, struct wl_resource *resource,
 
 	pool->data = data;
 	pool->size = size;
+
+	/* Clients usually grow the file before the pool, in which case
+	 * the file still covers the whole mapping. */
+	__atomic_store_n(&pool->sigbus_is_impossible,
+			 pool->fd >= 0 && fd_covers(pool->fd, size),
+			 __ATOMIC_RELAXED);
 }
 
 struct wl_shm_pool_interface shm_pool_interface = {
@@ -230,17 +302,28 @@ shm_create_pool(struct wl_client *client, struct wl_resource *resource,
 {
 	struct wl_shm_pool *pool;
 
-	pool = malloc(sizeof *pool);
-	if (pool == NULL) {
-		wl_client_post_no_memory(client);
-		goto err_close;
-	}
-
 	if (size <= 0) {
 		wl_resource_post_error(resource,
 				       WL_SHM_ERROR_INVALID_STRIDE,
 				       "invalid size (%d)", size);
-		goto err_free;
+		goto err_close;
+	}
+
+	if (wl_client_charge(client, WL_CLIENT_LIMIT_SHM, size) < 0) {
+		wl_client_post_no_memory(client);
+		goto err_close;
+	}
+
+	if (wl_client_charge(client, WL_CLIENT_LIMIT_MEMORY,
+			     sizeof *pool) < 0) {
+		wl_client_post_no_memory(client);
+		goto err_uncharge_shm;
+	}
+
+	pool = malloc(sizeof *pool);
+	if (pool == NULL) {
+		wl_client_post_no_memory(client);
+		goto err_uncharge;
 	}
 
 	pool->refcount = 1;
@@ -251,16 +334,28 @@ shm_create_pool(struct wl_client *client, struct wl_resource *resource,
 		wl_resource_post_error(resource,
 				       WL_SHM_ERROR_INVALID_FD,
 				       "failed mmap fd %d", fd);
-		goto err_close;
+		goto err_free;
+	}
+	if (fd_is_sealed(fd)) {
+		pool->fd = fd;
+		pool->sigbus_is_impossible = fd_covers(fd, size);
+	} else {
+		pool->fd = -1;
+		pool->sigbus_is_impossible = false;
+		close(fd);
 	}
-	close(fd);
 
 	pool->resource =
 		wl_resource_create(client, &wl_shm_pool_interface, 1, id);
 	if (!pool->resource) {
 		wl_client_post_no_memory(client);
 		munmap(pool->data, pool->size);
+		if (pool->fd >= 0)
+			close(pool->fd);
 		free(pool);
+		wl_client_uncharge(client, WL_CLIENT_LIMIT_MEMORY,
+				   sizeof *pool);
+		wl_client_uncharge(client, WL_CLIENT_LIMIT_SHM, size);
 		return;
 	}
 
@@ -270,10 +365,14 @@ shm_create_pool(struct wl_client *client, struct wl_resource *resource,
 
 	return;
 
-err_close:
-	close(fd);
 err_free:
 	free(pool);
+err_uncharge:
+	wl_client_uncharge(client, WL_CLIENT_LIMIT_MEMORY, sizeof *pool);
+err_uncharge_shm:
+	wl_client_uncharge(client, WL_CLIENT_LIMIT_SHM, size);
+err_close:
+	close(fd);
 }
 
 static const struct wl_shm_interface shm_interface = {
@@ -314,6 +413,33 @@ wl_display_init_shm(struct wl_display *display)
 	return 0;
 }
 
+/* Pools and buffers hold a mapping of a file we no longer have an fd
+ * for, so they cannot be handed to another process. */
+int
+wl_shm_resource_is_mapping(struct wl_resource *resource)
+{
+	return wl_resource_instance_of(resource, &wl_shm_pool_interface,
+				       &shm_pool_interface) ||
+		wl_resource_instance_of(resource, &wl_buffer_interface,
+					&shm_buffer_interface);
+}
+
+/* Recreate a wl_shm object imported from another process.  The formats
+ * were already sent, so unlike bind_shm() this does not send any. */
+int
+wl_shm_restore(struct wl_client *client, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &wl_shm_interface, version, id);
+	if (!resource)
+		return -1;
+
+	wl_resource_set_implementation(resource, &shm_interface, NULL, NULL);
+
+	return 0;
+}
+
 WL_EXPORT struct wl_shm_buffer *
 wl_shm_buffer_get(struct wl_resource *resource)
 {
@@ -488,6 +614,7 @@ init_sigbus_data_key(void)
 	sigaction(SIGBUS, &new_action, &wl_shm_old_sigbus_action);
 
 	pthread_key_create(&wl_shm_sigbus_data_key, destroy_sigbus_data);
+	__atomic_store_n(&wl_shm_sigbus_key_created, true, __ATOMIC_RELEASE);
 }
 
 /** Mark that the given SHM buffer is about to be accessed
@@ -517,6 +644,11 @@ init_sigbus_data_key(void)
  * reraise the signal which would will likely cause the compositor to
  * terminate.
  *
+ * If the client created the pool from a memfd sealed with
+ * F_SEAL_SHRINK that covers the whole pool, the file cannot shrink
+ * under the compositor and these functions return right away. This
+ * is checked again when the client resizes the pool.
+ *
  * It is safe to nest calls to these functions as long as the nested
  * calls are all accessing the same buffer. The number of calls to
  * wl_shm_buffer_end_access must match the number of calls to
@@ -532,6 +664,9 @@ wl_shm_buffer_begin_access(struct wl_shm_buffer *buffer)
 	struct wl_shm_pool *pool = buffer->pool;
 	struct wl_shm_sigbus_data *sigbus_data;
 
+	if (__atomic_load_n(&pool->sigbus_is_impossible, __ATOMIC_RELAXED))
+		return;
+
 	pthread_once(&wl_shm_sigbus_once, init_sigbus_data_key);
 
 	sigbus_data = pthread_getspecific(wl_shm_sigbus_data_key);
@@ -564,10 +699,20 @@ wl_shm_buffer_begin_access(struct wl_shm_buffer *buffer)
 WL_EXPORT void
 wl_shm_buffer_end_access(struct wl_shm_buffer *buffer)
 {
-	struct wl_shm_sigbus_data *sigbus_data =
-		pthread_getspecific(wl_shm_sigbus_data_key);
+	struct wl_shm_sigbus_data *sigbus_data;
+
+	/* The pool may have been resized since the access began, so
+	 * look at what wl_shm_buffer_begin_access recorded rather than
+	 * at the pool: without an access on this pool in the thread's
+	 * data, it took the fast path. */
+	if (!__atomic_load_n(&wl_shm_sigbus_key_created, __ATOMIC_ACQUIRE))
+		return;
+
+	sigbus_data = pthread_getspecific(wl_shm_sigbus_data_key);
+	if (sigbus_data == NULL || sigbus_data->current_pool != buffer->pool)
+		return;
 
-	assert(sigbus_data && sigbus_data->access_count >= 1);
+	assert(sigbus_data->access_count >= 1);
 
 	if (--sigbus_data->access_count == 0) {
 		if (sigbus_data->fallback_mapping_used) {
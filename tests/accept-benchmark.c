@@ -0,0 +1,139 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "wayland-server.h"
+
+/* Number of clients connecting at once.  Must stay below the listen()
+ * backlog, or connect() would block. */
+#define BURST_SIZE	100
+#define ROUNDS		50
+
+static int
+listening_socket(struct sockaddr_un *addr)
+{
+	const char *dir;
+	int fd;
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir)
+		dir = "/tmp";
+
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_LOCAL;
+	snprintf(addr->sun_path, sizeof addr->sun_path,
+		 "%s/wayland-accept-benchmark-%d", dir, getpid());
+	unlink(addr->sun_path);
+
+	fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	assert(fd >= 0);
+	assert(bind(fd, (struct sockaddr *) addr, sizeof *addr) == 0);
+	assert(listen(fd, 128) == 0);
+
+	return fd;
+}
+
+static int
+backlog_empty(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+
+	return poll(&pfd, 1, 0) == 0;
+}
+
+static long
+elapsed_usec(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_sec - start->tv_sec) * 1000000L +
+		(stop->tv_nsec - start->tv_nsec) / 1000;
+}
+
+int main(void)
+{
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct sockaddr_un addr;
+	struct timespec start, stop;
+	int fds[BURST_SIZE];
+	int sock_fd, round, i, dispatches;
+	long usec, total_usec = 0, max_usec = 0, total_dispatches = 0;
+
+	display = wl_display_create();
+	assert(display);
+	loop = wl_display_get_event_loop(display);
+
+	sock_fd = listening_socket(&addr);
+	assert(wl_display_add_socket_fd(display, sock_fd) == 0);
+
+	for (round = 0; round < ROUNDS; round++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (i = 0; i < BURST_SIZE; i++) {
+			fds[i] = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			assert(fds[i] >= 0);
+			assert(connect(fds[i], (struct sockaddr *) &addr,
+				       sizeof addr) == 0);
+		}
+
+		/* Time until the compositor has created a wl_client for
+		 * every connection of the storm. */
+		dispatches = 0;
+		while (!backlog_empty(sock_fd)) {
+			wl_event_loop_dispatch(loop, 0);
+			dispatches++;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+
+		usec = elapsed_usec(&start, &stop);
+		total_usec += usec;
+		total_dispatches += dispatches;
+		if (usec > max_usec)
+			max_usec = usec;
+
+		/* Hang up and let the server tear the clients down */
+		for (i = 0; i < BURST_SIZE; i++)
+			close(fds[i]);
+		for (i = 0; i < BURST_SIZE / 32 + 2; i++)
+			wl_event_loop_dispatch(loop, 0);
+	}
+
+	printf("benchmarked accept of %d clients:\t"
+	       "avg %ldus, max %ldus, %.1f dispatches per burst\n",
+	       BURST_SIZE, total_usec / ROUNDS, max_usec,
+	       (double) total_dispatches / ROUNDS);
+
+	wl_display_destroy(display);
+	unlink(addr.sun_path);
+
+	return 0;
+}
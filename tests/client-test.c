@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 
 #include "wayland-private.h"
 #include "wayland-server.h"
@@ -89,3 +90,91 @@ TEST(client_destroy_listener)
 	wl_display_destroy(display);
 }
 
+TEST(client_request_batch)
+{
+	struct wl_display *display;
+	struct wl_client *client;
+	struct wl_event_loop *loop;
+	uint32_t requests[300 * 3];
+	int s[2], i;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	loop = wl_display_get_event_loop(display);
+
+	/* wl_display.get_registry (opcode 1), one new object each */
+	for (i = 0; i < 300; i++) {
+		requests[i * 3] = 1;
+		requests[i * 3 + 1] = 12 << 16 | 1;
+		requests[i * 3 + 2] = i + 2;
+	}
+	assert(write(s[1], requests, sizeof requests) == sizeof requests);
+
+	/* one wakeup only dispatches a batch, the rest comes next time
+	 * even though the socket doesn't become readable again */
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(wl_client_get_usage(client, WL_CLIENT_LIMIT_OBJECTS) == 1 + 256);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(wl_client_get_usage(client, WL_CLIENT_LIMIT_OBJECTS) == 1 + 300);
+
+	wl_client_destroy(client);
+	close(s[1]);
+
+	wl_display_destroy(display);
+}
+
+TEST(client_flush_when_writable)
+{
+	struct wl_display *display;
+	struct wl_client *client;
+	struct wl_resource *resource;
+	struct wl_event_loop *loop;
+	char buffer[4096];
+	int s[2], i, queued, posted = 0, received = 0, size = 4096;
+	ssize_t len;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	assert(setsockopt(s[0], SOL_SOCKET, SO_SNDBUF,
+			  &size, sizeof size) == 0);
+	display = wl_display_create();
+	assert(display);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	resource = wl_client_get_object(client, 1);
+	assert(resource);
+	loop = wl_display_get_event_loop(display);
+
+	test_set_timeout(4);
+
+	/* send wl_display.delete_id events until the socket is full and
+	 * some of them stay behind in the out buffer */
+	do {
+		for (i = 0; i < 100; i++)
+			wl_resource_post_event(resource,
+					       WL_DISPLAY_DELETE_ID, i);
+		posted += 100 * 12;
+		wl_display_flush_clients(display);
+		assert(ioctl(s[1], FIONREAD, &queued) == 0);
+	} while (queued == posted);
+
+	/* once the client reads, the socket reports writable without the
+	 * compositor asking for it again, and the rest goes out */
+	while (received < posted) {
+		len = recv(s[1], buffer, sizeof buffer, MSG_DONTWAIT);
+		if (len < 0) {
+			assert(errno == EAGAIN);
+			assert(wl_event_loop_dispatch(loop, 0) == 0);
+			continue;
+		}
+		received += len;
+	}
+	assert(received == posted);
+
+	wl_client_destroy(client);
+	close(s[1]);
+
+	wl_display_destroy(display);
+}
@@ -420,6 +420,39 @@ TEST(connection_demarshal)
 	release_marshal_data(&data);
 }
 
+TEST(connection_demarshal_recycle)
+{
+	struct marshal_data data;
+	struct wl_message message = { "test", "uu", NULL };
+	struct wl_closure *closure, *recycled;
+	struct wl_map objects;
+	uint32_t msg[4] = { 400200, 16, 1, 2 };
+
+	setup_marshal_data(&data);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	assert(write(data.s[1], msg, sizeof msg) == sizeof msg);
+	assert(write(data.s[1], msg, sizeof msg) == sizeof msg);
+	assert(wl_connection_read(data.read_connection) == 2 * sizeof msg);
+
+	closure = wl_connection_demarshal(data.read_connection,
+					  sizeof msg, &objects, &message);
+	assert(closure);
+	assert(closure->args[0].u == 1 && closure->args[1].u == 2);
+	wl_closure_recycle(closure, data.read_connection);
+
+	/* A small closure released to the connection is handed out again
+	 * for the next message */
+	recycled = wl_connection_demarshal(data.read_connection,
+					   sizeof msg, &objects, &message);
+	assert(recycled == closure);
+	assert(recycled->args[0].u == 1 && recycled->args[1].u == 2);
+	wl_closure_recycle(recycled, data.read_connection);
+
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
 static void
 marshal_demarshal(struct marshal_data *data,
 		  void (*func)(void), int size, const char *format, ...)
@@ -538,6 +571,102 @@ TEST(connection_marshal_too_big)
 	free(big_string);
 }
 
+static void
+send_queued(struct marshal_data *data, const struct wl_message *messages,
+	    uint32_t opcode, ...)
+{
+	static struct wl_object sender = { NULL, NULL, 1234 };
+	struct wl_closure *closure;
+	va_list ap;
+
+	va_start(ap, opcode);
+	closure = wl_closure_vmarshal(&sender, opcode, ap, &messages[opcode]);
+	va_end(ap);
+
+	assert(closure);
+	assert(wl_closure_send(closure, data->write_connection) == 0);
+	wl_closure_destroy(closure);
+}
+
+#define QUEUED_FD_MESSAGES 100
+
+TEST(connection_queue_when_full)
+{
+	static const struct wl_message messages[] = {
+		{ "pad", "s", NULL },
+		{ "fd", "uh", NULL },
+	};
+	struct marshal_data data;
+	struct wl_closure *closure;
+	struct wl_map objects;
+	struct stat buf1, buf2;
+	char f[] = "/tmp/wayland-tests-XXXXXX";
+	char pad[2048];
+	uint32_t header[2], next = 0;
+	int fd, size, opcode, i;
+
+	setup_marshal_data(&data);
+	wl_connection_set_queue_when_full(data.write_connection, 1);
+	wl_map_init(&objects, WL_MAP_SERVER_SIDE);
+
+	fd = mkstemp(f);
+	assert(fd >= 0);
+	unlink(f);
+	assert(fstat(fd, &buf1) == 0);
+
+	/* fill the socket and the 4 KiB out buffer, then queue messages
+	 * with more fds than fit in one sendmsg behind them */
+	memset(pad, 'x', sizeof pad - 1);
+	pad[sizeof pad - 1] = '\0';
+	for (i = 0; wl_connection_pending_output(data.write_connection) <=
+		    2 * sizeof pad; i++) {
+		assert(i < 10000);
+		send_queued(&data, messages, 0, pad);
+	}
+	for (i = 0; i < QUEUED_FD_MESSAGES; i++)
+		send_queued(&data, messages, 1, i, fd);
+	close(fd);
+
+	/* every message arrives whole and in order, with its fd */
+	while (next < QUEUED_FD_MESSAGES) {
+		if (wl_connection_pending_input(data.read_connection) <
+		    sizeof header) {
+			if (wl_connection_read(data.read_connection) < 0) {
+				assert(errno == EAGAIN);
+				wl_connection_flush(data.write_connection);
+			}
+			continue;
+		}
+
+		wl_connection_copy(data.read_connection, header, sizeof header);
+		size = header[1] >> 16;
+		opcode = header[1] & 0xffff;
+		if (wl_connection_pending_input(data.read_connection) <
+		    (uint32_t) size) {
+			if (wl_connection_read(data.read_connection) < 0) {
+				assert(errno == EAGAIN);
+				wl_connection_flush(data.write_connection);
+			}
+			continue;
+		}
+
+		closure = wl_connection_demarshal(data.read_connection, size,
+						  &objects, &messages[opcode]);
+		assert(closure);
+		if (opcode == 1) {
+			assert(closure->args[0].u == next++);
+			assert(fstat(closure->args[1].h, &buf2) == 0);
+			assert(buf1.st_ino == buf2.st_ino);
+			close(closure->args[1].h);
+		}
+		wl_closure_destroy(closure);
+	}
+	assert(wl_connection_pending_output(data.write_connection) == 0);
+
+	wl_map_release(&objects);
+	release_marshal_data(&data);
+}
+
 static void
 marshal_helper(const char *format, void *handler, ...)
 {
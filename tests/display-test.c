@@ -674,6 +674,288 @@ TEST(threading_read_after_error_tst)
 	display_destroy(d);
 }
 
+struct targeted_reader {
+	struct client *c;
+	struct wl_event_queue *queue;
+	int returned;
+};
+
+static void *
+thread_read_queue(void *data)
+{
+	struct targeted_reader *reader = data;
+	struct wl_display *display = reader->c->wl_display;
+
+	while (wl_display_prepare_read_queue(display, reader->queue) != 0)
+		assert(wl_display_dispatch_queue_pending(display,
+							 reader->queue) >= 0);
+
+	reader->c->display_stopped = 1;
+	assert(wl_display_read_events(display) == 0);
+	__atomic_store_n(&reader->returned, 1, __ATOMIC_RELEASE);
+
+	pthread_exit(NULL);
+}
+
+static void
+sync_done(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	bool *done = data;
+
+	*done = true;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener sync_done_listener = {
+	sync_done
+};
+
+static void
+sync_count(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	int *count = data;
+
+	(*count)++;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener sync_count_listener = {
+	sync_count
+};
+
+static void
+start_targeted_reader(struct targeted_reader *reader, pthread_t *thread)
+{
+	reader->queue = wl_display_create_queue(reader->c->wl_display);
+	assert(reader->queue);
+
+	reader->c->display_stopped = 0;
+	assert(pthread_create(thread, NULL, thread_read_queue, reader) == 0);
+	while (reader->c->display_stopped == 0)
+		test_usleep(500);
+	test_usleep(10000);
+}
+
+/* Test that a read only wakes up the threads whose queue received
+ * events, plus one other sleeping thread whose caller then reads
+ * again, and that the threads still sleeping get their events read. */
+static void
+threading_targeted_wakeup(void)
+{
+	DISABLE_LEAK_CHECKS;
+
+	struct client *c = client_connect();
+	struct targeted_reader readers[2] = { { c, NULL, 0 }, { c, NULL, 0 } };
+	struct targeted_reader *sleeping;
+	struct wl_callback *callback;
+	struct pollfd pfd;
+	bool done = false, queue_done = false;
+	pthread_t threads[2];
+	int woken;
+
+	register_reading(c->wl_display);
+	start_targeted_reader(&readers[0], &threads[0]);
+	start_targeted_reader(&readers[1], &threads[1]);
+
+	callback = wl_display_sync(c->wl_display);
+	assert(callback);
+	wl_callback_add_listener(callback, &sync_done_listener, &done);
+	assert(wl_display_flush(c->wl_display) >= 0);
+
+	pfd.fd = wl_display_get_fd(c->wl_display);
+	pfd.events = POLLIN;
+	assert(poll(&pfd, 1, -1) == 1);
+	assert(wl_display_read_events(c->wl_display) == 0);
+	assert(wl_display_dispatch_pending(c->wl_display) >= 1);
+	assert(done);
+
+	/* nothing arrived for the other queues, so only one of their
+	 * threads returns to read again, the other sleeps on */
+	test_usleep(10000);
+	woken = __atomic_load_n(&readers[0].returned, __ATOMIC_ACQUIRE) ? 0 : 1;
+	sleeping = &readers[!woken];
+	assert(__atomic_load_n(&readers[woken].returned, __ATOMIC_ACQUIRE));
+	assert(!__atomic_load_n(&sleeping->returned, __ATOMIC_ACQUIRE));
+	pthread_join(threads[woken], NULL);
+
+	callback = wl_display_sync(c->wl_display);
+	assert(callback);
+	wl_proxy_set_queue((struct wl_proxy *) callback, sleeping->queue);
+	wl_callback_add_listener(callback, &sync_done_listener, &queue_done);
+	register_reading(c->wl_display);
+
+	assert(poll(&pfd, 1, -1) == 1);
+	assert(wl_display_read_events(c->wl_display) == 0);
+
+	test_set_timeout(3);
+	pthread_join(threads[!woken], NULL);
+	assert(sleeping->returned);
+
+	assert(wl_display_dispatch_queue_pending(c->wl_display,
+						 sleeping->queue) >= 1);
+	assert(queue_done);
+
+	wl_event_queue_destroy(readers[0].queue);
+	wl_event_queue_destroy(readers[1].queue);
+	client_disconnect(c);
+}
+
+TEST(threading_targeted_wakeup_tst)
+{
+	struct display *d = display_create();
+
+	client_create_noarg(d, threading_targeted_wakeup);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+static bool
+display_has_input(struct wl_display *display, int timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = wl_display_get_fd(display);
+	pfd.events = POLLIN;
+
+	return poll(&pfd, 1, timeout) == 1;
+}
+
+static void
+queue_sync(struct wl_display *display, int *count)
+{
+	struct wl_callback *callback;
+
+	callback = wl_display_sync(display);
+	assert(callback);
+	wl_callback_add_listener(callback, &sync_count_listener, count);
+}
+
+static void
+flush_policy(void)
+{
+	struct client *c = client_connect();
+	struct wl_display *display = c->wl_display;
+	int count = 0, i;
+
+	assert(wl_display_flush(display) >= 0);
+
+	/* nothing is sent until the message threshold is reached */
+	wl_display_set_flush_policy(display, WL_DISPLAY_FLUSH_MESSAGES, 0, 3);
+	queue_sync(display, &count);
+	queue_sync(display, &count);
+	assert(!display_has_input(display, 50));
+	queue_sync(display, &count);
+	assert(display_has_input(display, 2000));
+	assert(wl_display_roundtrip(display) != -1);
+	assert(count == 3);
+
+	/* a corked display holds back the whole batch */
+	wl_display_cork(display);
+	wl_display_cork(display);
+	for (i = 0; i < 5; i++)
+		queue_sync(display, &count);
+	assert(wl_display_uncork(display) == 0);
+	assert(!display_has_input(display, 50));
+	assert(wl_display_uncork(display) > 0);
+	assert(display_has_input(display, 2000));
+	assert(wl_display_roundtrip(display) != -1);
+	assert(count == 8);
+
+	/* a sync request is 12 bytes */
+	wl_display_set_flush_policy(display, WL_DISPLAY_FLUSH_BYTES, 24, 0);
+	queue_sync(display, &count);
+	assert(!display_has_input(display, 50));
+	queue_sync(display, &count);
+	assert(display_has_input(display, 2000));
+	assert(wl_display_roundtrip(display) != -1);
+	assert(count == 10);
+
+	wl_display_set_flush_policy(display, WL_DISPLAY_FLUSH_BEFORE_READ,
+				    0, 0);
+	queue_sync(display, &count);
+	assert(!display_has_input(display, 50));
+	assert(wl_display_prepare_read(display) == 0);
+	assert(display_has_input(display, 2000));
+	assert(wl_display_read_events(display) == 0);
+	assert(wl_display_dispatch_pending(display) >= 1);
+	assert(count == 11);
+
+	client_disconnect(c);
+}
+
+TEST(flush_policy_tst)
+{
+	struct display *d = display_create();
+
+	test_set_timeout(4);
+
+	client_create_noarg(d, flush_policy);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+#define FULL_SOCKET_SYNCS 100000
+
+/* A compositor that stops reading fills the socket; requests then stay
+ * queued in the client until a flush finds room, in order. */
+TEST(full_socket_queues_requests)
+{
+	struct wl_display *display;
+	struct wl_callback *callback;
+	uint32_t buf[3 * 64], first_id = 0, next_id = 0;
+	ssize_t len;
+	int s[2], i, n, ret;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_connect_to_fd(s[0]);
+	assert(display);
+
+	test_set_timeout(4);
+
+	for (i = 0; i < FULL_SOCKET_SYNCS; i++) {
+		callback = wl_display_sync(display);
+		assert(callback);
+		if (i == 0)
+			first_id = wl_proxy_get_id((struct wl_proxy *) callback);
+		wl_callback_destroy(callback);
+	}
+	assert(wl_display_get_error(display) == 0);
+
+	ret = wl_display_flush(display);
+	assert(ret == -1 && errno == EAGAIN);
+	assert(wl_display_get_error(display) == 0);
+
+	/* drain the socket until everything went out, checking that the
+	 * requests arrive complete and in order */
+	next_id = first_id;
+	n = 0;
+	while (next_id != first_id + FULL_SOCKET_SYNCS) {
+		len = recv(s[1], buf, sizeof buf, MSG_DONTWAIT);
+		if (len < 0) {
+			assert(errno == EAGAIN);
+			ret = wl_display_flush(display);
+			assert(ret >= 0 || errno == EAGAIN);
+			continue;
+		}
+
+		/* wl_display.sync: object 1, opcode 0, 12 bytes, new id */
+		assert(len % 12 == 0);
+		for (i = 0; i < len / 4; i += 3) {
+			assert(buf[i] == 1);
+			assert(buf[i + 1] == (12 << 16));
+			assert(buf[i + 2] == next_id++);
+		}
+		n += len / 12;
+	}
+	assert(n == FULL_SOCKET_SYNCS);
+	assert(wl_display_flush(display) == 0);
+
+	wl_display_disconnect(display);
+	close(s[1]);
+}
+
 static void
 wait_for_error_using_dispatch(struct client *c, struct wl_proxy *proxy)
 {
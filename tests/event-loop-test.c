@@ -25,10 +25,14 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "wayland-private.h"
 #include "wayland-server.h"
@@ -69,6 +73,477 @@ TEST(event_loop_post_dispatch_check)
 	wl_event_loop_destroy(loop);
 }
 
+static int
+fd_count_dispatch(int fd, uint32_t mask, void *data)
+{
+	int *p = data;
+
+	assert(mask & WL_EVENT_READABLE);
+	++(*p);
+
+	return 0;
+}
+
+TEST(event_loop_fd_edge_triggered)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *source;
+	int dispatch_ran = 0;
+	int p[2];
+	char c = 'x';
+
+	assert(loop);
+	assert(pipe(p) == 0);
+
+	source = wl_event_loop_add_fd(loop, p[0], WL_EVENT_READABLE |
+				      WL_EVENT_EDGE_TRIGGERED,
+				      fd_count_dispatch, &dispatch_ran);
+	assert(source);
+
+	/* the unread byte is only reported once */
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 1);
+
+	/* until more data arrives */
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 2);
+
+	assert(close(p[0]) == 0);
+	assert(close(p[1]) == 0);
+	wl_event_source_remove(source);
+	wl_event_loop_destroy(loop);
+}
+
+struct priority_context {
+	int p1[2], p2[2];
+	int order[3];
+	int count;
+};
+
+static int
+priority_dispatch(int fd, uint32_t mask, void *data)
+{
+	struct priority_context *context = data;
+	char c;
+
+	assert(read(fd, &c, 1) == 1);
+	context->order[context->count++] = fd;
+
+	return 0;
+}
+
+TEST(event_loop_priority)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *normal, *high;
+	struct priority_context context = { .count = 0 };
+	char c = 'x';
+
+	assert(loop);
+	assert(pipe(context.p1) == 0);
+	assert(pipe(context.p2) == 0);
+
+	normal = wl_event_loop_add_fd(loop, context.p1[0], WL_EVENT_READABLE,
+				      priority_dispatch, &context);
+	assert(normal);
+	high = wl_event_loop_add_fd(loop, context.p2[0], WL_EVENT_READABLE,
+				    priority_dispatch, &context);
+	assert(high);
+	assert(wl_event_source_set_priority(high,
+					    WL_EVENT_PRIORITY_HIGH) == 0);
+
+	/* the normal source becomes ready first but runs last */
+	assert(write(context.p1[1], &c, 1) == 1);
+	assert(write(context.p2[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(context.count == 2);
+	assert(context.order[0] == context.p2[0]);
+	assert(context.order[1] == context.p1[0]);
+
+	/* moving back to the normal class keeps the source working */
+	assert(wl_event_source_set_priority(high,
+					    WL_EVENT_PRIORITY_NORMAL) == 0);
+	assert(write(context.p2[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(context.count == 3);
+
+	wl_event_source_remove(normal);
+	wl_event_source_remove(high);
+	assert(close(context.p1[0]) == 0);
+	assert(close(context.p1[1]) == 0);
+	assert(close(context.p2[0]) == 0);
+	assert(close(context.p2[1]) == 0);
+	wl_event_loop_destroy(loop);
+}
+
+TEST(event_loop_busy_poll)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *source;
+	int dispatch_ran = 0;
+	uint64_t spin, sleep;
+	int p[2];
+	char c = 'x';
+
+	assert(loop);
+	assert(pipe(p) == 0);
+	source = wl_event_loop_add_fd(loop, p[0], WL_EVENT_READABLE,
+				      fd_count_dispatch, &dispatch_ran);
+	assert(source);
+
+	wl_event_loop_set_busy_poll(loop, 2000);
+
+	/* no activity yet: plain blocking wait */
+	wl_event_loop_dispatch(loop, 1);
+	wl_event_loop_get_busy_poll_stats(loop, &spin, &sleep);
+	assert(spin == 0);
+
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 1);
+	assert(read(p[0], &c, 1) == 1);
+
+	/* after activity the loop spins for its budget, then blocks */
+	wl_event_loop_dispatch(loop, 10);
+	wl_event_loop_get_busy_poll_stats(loop, &spin, &sleep);
+	assert(spin >= 2000 * 1000);
+	assert(sleep > 0);
+
+	assert(close(p[0]) == 0);
+	assert(close(p[1]) == 0);
+	wl_event_source_remove(source);
+	wl_event_loop_destroy(loop);
+}
+
+struct idle_task_context {
+	struct wl_event_loop *loop;
+	struct wl_idle_task task;
+	int count;
+};
+
+static void
+idle_task_func(struct wl_idle_task *task)
+{
+	struct idle_task_context *context =
+		container_of(task, struct idle_task_context, task);
+
+	context->count++;
+
+	/* rescheduling from the task runs it in the next round */
+	if (context->count == 2)
+		wl_event_loop_schedule_idle_task(context->loop, task);
+}
+
+TEST(event_loop_idle_task)
+{
+	struct idle_task_context context = { 0 };
+
+	context.loop = wl_event_loop_create();
+	assert(context.loop);
+	wl_idle_task_init(&context.task, idle_task_func);
+	assert(!wl_idle_task_is_scheduled(&context.task));
+
+	/* scheduling twice runs it once */
+	wl_event_loop_schedule_idle_task(context.loop, &context.task);
+	wl_event_loop_schedule_idle_task(context.loop, &context.task);
+	assert(wl_idle_task_is_scheduled(&context.task));
+	wl_event_loop_dispatch_idle(context.loop);
+	assert(context.count == 1);
+	assert(!wl_idle_task_is_scheduled(&context.task));
+
+	wl_event_loop_schedule_idle_task(context.loop, &context.task);
+	wl_event_loop_dispatch_idle(context.loop);
+	assert(context.count == 2);
+	assert(wl_idle_task_is_scheduled(&context.task));
+	wl_event_loop_dispatch_idle(context.loop);
+	assert(context.count == 3);
+
+	wl_event_loop_schedule_idle_task(context.loop, &context.task);
+	wl_idle_task_cancel(&context.task);
+	wl_event_loop_dispatch_idle(context.loop);
+	assert(context.count == 3);
+
+	/* destroying the loop unschedules pending tasks */
+	wl_event_loop_schedule_idle_task(context.loop, &context.task);
+	wl_event_loop_destroy(context.loop);
+	assert(!wl_idle_task_is_scheduled(&context.task));
+}
+
+static void
+idle_task_reschedule(struct wl_idle_task *task)
+{
+	struct idle_task_context *context =
+		container_of(task, struct idle_task_context, task);
+
+	context->count++;
+	wl_event_loop_schedule_idle_task(context->loop, task);
+}
+
+TEST(event_loop_idle_task_reschedule)
+{
+	struct idle_task_context context = { 0 };
+	int i;
+
+	context.loop = wl_event_loop_create();
+	assert(context.loop);
+	wl_idle_task_init(&context.task, idle_task_reschedule);
+	wl_event_loop_schedule_idle_task(context.loop, &context.task);
+
+	/* a pending task keeps a blocking dispatch from sleeping */
+	test_set_timeout(2);
+	for (i = 1; i <= 5; i++) {
+		assert(wl_event_loop_dispatch(context.loop, -1) == 0);
+		assert(context.count >= i);
+	}
+
+	wl_event_loop_destroy(context.loop);
+}
+
+static int
+slow_dispatch(int fd, uint32_t mask, void *data)
+{
+	char c;
+
+	assert(read(fd, &c, 1) == 1);
+	usleep(2000);
+
+	return 0;
+}
+
+TEST(event_loop_profiling)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *source;
+	uint64_t count, total, max, wait;
+	int p[2];
+	char c = 'x';
+
+	assert(loop);
+	assert(pipe(p) == 0);
+	source = wl_event_loop_add_fd(loop, p[0], WL_EVENT_READABLE,
+				      slow_dispatch, NULL);
+	assert(source);
+
+	/* nothing is accounted until profiling is turned on */
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	wl_event_source_get_dispatch_stats(source, &count, &total, &max);
+	assert(count == 0 && total == 0 && max == 0);
+
+	wl_event_loop_set_profiling(loop, 1);
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	wl_event_source_get_dispatch_stats(source, &count, &total, &max);
+	assert(count == 2);
+	assert(max >= 2000000);
+	assert(total >= 4000000 && total >= max);
+
+	wl_event_loop_dispatch(loop, 5);
+	wl_event_loop_get_dispatch_stats(loop, &wait, NULL);
+	assert(wait >= 4000000);
+
+	assert(close(p[0]) == 0);
+	assert(close(p[1]) == 0);
+	wl_event_source_remove(source);
+	wl_event_loop_destroy(loop);
+}
+
+TEST(event_loop_deadline)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *source;
+	struct timespec deadline;
+	int dispatch_ran = 0;
+	int p[2];
+	char c = 'x';
+
+	assert(loop);
+	assert(pipe(p) == 0);
+	source = wl_event_loop_add_fd(loop, p[0], WL_EVENT_READABLE |
+				      WL_EVENT_EDGE_TRIGGERED,
+				      fd_count_dispatch, &dispatch_ran);
+	assert(source);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += 1;
+	wl_event_loop_set_deadline(loop, &deadline, 0);
+	assert(!wl_event_loop_deadline_reached(loop));
+
+	/* within the margin, ready sources are held back... */
+	wl_event_loop_set_deadline(loop, &deadline, 2000000);
+	assert(wl_event_loop_deadline_reached(loop));
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 0);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 0);
+
+	/* ...and run once the deadline moves, even though the
+	 * edge-triggered fd does not report them again */
+	wl_event_loop_set_deadline(loop, NULL, 0);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 1);
+
+	assert(close(p[0]) == 0);
+	assert(close(p[1]) == 0);
+	wl_event_source_remove(source);
+	wl_event_loop_destroy(loop);
+}
+
+static void
+count_task(void *data)
+{
+	int *count = data;
+
+	++(*count);
+}
+
+TEST(event_loop_deadline_suspends)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *source;
+	struct timespec deadline;
+	struct pollfd pfd;
+	int dispatch_ran = 0, tasks_ran = 0;
+	int p[2];
+	char c = 'x';
+
+	assert(loop);
+	assert(pipe(p) == 0);
+	source = wl_event_loop_add_fd(loop, p[0], WL_EVENT_READABLE,
+				      fd_count_dispatch, &dispatch_ran);
+	assert(source);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	wl_event_loop_set_deadline(loop, &deadline, 0);
+	assert(write(p[1], &c, 1) == 1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 0);
+
+	/* the unread level-triggered fd no longer wakes up the loop */
+	pfd.fd = wl_event_loop_get_fd(loop);
+	pfd.events = POLLIN;
+	assert(poll(&pfd, 1, 0) == 0);
+
+	/* tasks posted to the loop are not held back */
+	assert(wl_event_loop_post(loop, count_task, &tasks_ran) == 0);
+	wl_event_loop_dispatch(loop, 1000);
+	assert(tasks_ran == 1);
+	assert(dispatch_ran == 0);
+
+	wl_event_loop_set_deadline(loop, NULL, 0);
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 1);
+
+	/* once resumed, the fd is reported again while unread */
+	wl_event_loop_dispatch(loop, 0);
+	assert(dispatch_ran == 2);
+
+	assert(close(p[0]) == 0);
+	assert(close(p[1]) == 0);
+	wl_event_source_remove(source);
+	wl_event_loop_destroy(loop);
+}
+
+static int
+fd_read_dispatch(int fd, uint32_t mask, void *data)
+{
+	int *count = data;
+	char c;
+
+	assert(read(fd, &c, 1) == 1);
+	++(*count);
+
+	return 0;
+}
+
+TEST(event_loop_batch_grows)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *sources[100];
+	int p[100][2];
+	int i, count = 0;
+	char c = 'x';
+
+	assert(loop);
+	for (i = 0; i < 100; i++) {
+		assert(pipe(p[i]) == 0);
+		sources[i] = wl_event_loop_add_fd(loop, p[i][0],
+						  WL_EVENT_READABLE,
+						  fd_read_dispatch, &count);
+		assert(sources[i]);
+		assert(write(p[i][1], &c, 1) == 1);
+	}
+
+	/* the batch starts at 32 events and doubles when filled */
+	wl_event_loop_dispatch(loop, 0);
+	assert(count == 32);
+	wl_event_loop_dispatch(loop, 0);
+	assert(count == 96);
+	wl_event_loop_dispatch(loop, 0);
+	assert(count == 100);
+
+	for (i = 0; i < 100; i++) {
+		wl_event_source_remove(sources[i]);
+		close(p[i][0]);
+		close(p[i][1]);
+	}
+	wl_event_loop_destroy(loop);
+}
+
+TEST(event_loop_batch_limit)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *sources[100];
+	int p[100][2];
+	int i, count = 0;
+	char c = 'x';
+
+	assert(loop);
+	assert(wl_event_loop_set_batch_limit(loop, 0) == -1);
+	assert(errno == EINVAL);
+	assert(wl_event_loop_set_batch_limit(loop, -1) == -1);
+	assert(errno == EINVAL);
+
+	for (i = 0; i < 100; i++) {
+		assert(pipe(p[i]) == 0);
+		sources[i] = wl_event_loop_add_fd(loop, p[i][0],
+						  WL_EVENT_READABLE,
+						  fd_read_dispatch, &count);
+		assert(sources[i]);
+		assert(write(p[i][1], &c, 1) == 1);
+	}
+
+	/* a full batch of 32 grows it to 64 events */
+	wl_event_loop_dispatch(loop, 0);
+	assert(count == 32);
+
+	/* a lower limit caps the grown batch ... */
+	assert(wl_event_loop_set_batch_limit(loop, 40) == 0);
+	wl_event_loop_dispatch(loop, 0);
+	assert(count == 72);
+
+	/* ... and a limit below the initial batch is honoured too */
+	assert(wl_event_loop_set_batch_limit(loop, 8) == 0);
+	wl_event_loop_dispatch(loop, 0);
+	assert(count == 80);
+	wl_event_loop_dispatch(loop, 0);
+	assert(count == 88);
+
+	for (i = 0; i < 100; i++) {
+		wl_event_source_remove(sources[i]);
+		close(p[i][0]);
+		close(p[i][1]);
+	}
+	wl_event_loop_destroy(loop);
+}
+
 struct free_source_context {
 	struct wl_event_source *source1, *source2;
 	int p1[2], p2[2];
@@ -215,6 +690,137 @@ TEST(event_loop_multiple_same_signals)
 	wl_event_loop_destroy(loop);
 }
 
+static int
+signal_count_callback(int signal_number, void *data)
+{
+	int *got = data;
+
+	got[signal_number == SIGUSR1 ? 0 : 1]++;
+
+	return 1;
+}
+
+TEST(event_loop_signals_share_fd)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *s1, *s2;
+	int got[2] = { 0, 0 };
+	int fds;
+
+	fds = count_open_fds();
+	s1 = wl_event_loop_add_signal(loop, SIGUSR1,
+				      signal_count_callback, got);
+	assert(s1);
+	s2 = wl_event_loop_add_signal(loop, SIGUSR2,
+				      signal_count_callback, got);
+	assert(s2);
+	assert(count_open_fds() == fds + 1);
+
+	/* both pending signals are drained in one wakeup */
+	kill(getpid(), SIGUSR1);
+	kill(getpid(), SIGUSR2);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(got[0] == 1);
+	assert(got[1] == 1);
+
+	/* removing a source takes its signal out of the shared mask */
+	wl_event_source_remove(s2);
+	kill(getpid(), SIGUSR1);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(got[0] == 2);
+	assert(got[1] == 1);
+
+	/* ... so it is neither read from the signalfd nor dispatched */
+	kill(getpid(), SIGUSR2);
+	assert(wl_event_loop_dispatch(loop, 0) == 0);
+	assert(got[1] == 1);
+
+	wl_event_source_remove(s1);
+	wl_event_loop_destroy(loop);
+}
+
+struct signal_priority_context {
+	int order[3];
+	int count;
+};
+
+static int
+signal_priority_fd(int fd, uint32_t mask, void *data)
+{
+	struct signal_priority_context *context = data;
+	char c;
+
+	assert(read(fd, &c, 1) == 1);
+	context->order[context->count++] = fd;
+
+	return 0;
+}
+
+static int
+signal_priority_signal(int signal_number, void *data)
+{
+	struct signal_priority_context *context = data;
+
+	context->order[context->count++] = -signal_number;
+
+	return 1;
+}
+
+TEST(event_loop_signal_priority)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *normal, *signal;
+	struct signal_priority_context context = { .count = 0 };
+	int got[2] = { 0, 0 };
+	int p[2];
+	char c = 'x';
+
+	assert(loop);
+	assert(pipe(p) == 0);
+	normal = wl_event_loop_add_fd(loop, p[0], WL_EVENT_READABLE,
+				      signal_priority_fd, &context);
+	assert(normal);
+	signal = wl_event_loop_add_signal(loop, SIGUSR1,
+					  signal_priority_signal, &context);
+	assert(signal);
+	assert(wl_event_source_set_priority(signal,
+					    WL_EVENT_PRIORITY_HIGH) == 0);
+
+	/* the shared signalfd moves to the high priority set */
+	assert(write(p[1], &c, 1) == 1);
+	kill(getpid(), SIGUSR1);
+	wl_event_loop_dispatch(loop, 0);
+	assert(context.count == 2);
+	assert(context.order[0] == -SIGUSR1);
+	assert(context.order[1] == p[0]);
+
+	/* signals added later share the high priority signalfd */
+	wl_event_source_remove(normal);
+	normal = wl_event_loop_add_signal(loop, SIGUSR2,
+					  signal_count_callback, got);
+	assert(normal);
+	kill(getpid(), SIGUSR2);
+	wl_event_loop_dispatch(loop, 0);
+	assert(got[1] == 1);
+
+	/* and it moves back once no signal source is high priority */
+	assert(wl_event_source_set_priority(signal,
+					    WL_EVENT_PRIORITY_NORMAL) == 0);
+	kill(getpid(), SIGUSR1);
+	kill(getpid(), SIGUSR2);
+	wl_event_loop_dispatch(loop, 0);
+	assert(context.count == 3);
+	assert(got[1] == 2);
+
+	assert(wl_event_source_set_priority(signal, 2) == -1);
+
+	wl_event_source_remove(normal);
+	wl_event_source_remove(signal);
+	assert(close(p[0]) == 0);
+	assert(close(p[1]) == 0);
+	wl_event_loop_destroy(loop);
+}
+
 static int
 timer_callback(void *data)
 {
@@ -245,6 +851,66 @@ TEST(event_loop_timer)
 
 #define MSEC_TO_USEC(msec) ((msec) * 1000)
 
+struct timer_order_context {
+	int order[4];
+	int count;
+};
+
+struct timer_order_data {
+	struct timer_order_context *context;
+	int index;
+};
+
+static int
+timer_order_callback(void *data)
+{
+	struct timer_order_data *timer = data;
+
+	timer->context->order[timer->context->count++] = timer->index;
+
+	return 1;
+}
+
+TEST(event_loop_timer_order)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct wl_event_source *sources[4];
+	struct timer_order_context context = { { 0 }, 0 };
+	struct timer_order_data timers[4];
+	static const int delays[4] = { 30, 10, 1000, 20 };
+	int i, fds;
+
+	fds = count_open_fds();
+	for (i = 0; i < 4; i++) {
+		timers[i].context = &context;
+		timers[i].index = i;
+		sources[i] = wl_event_loop_add_timer(loop, timer_order_callback,
+						     &timers[i]);
+		assert(sources[i]);
+		assert(wl_event_source_timer_update(sources[i],
+						    delays[i]) == 0);
+	}
+
+	/* all timers share a single timerfd */
+	assert(count_open_fds() == fds + 1);
+
+	/* disarming and removing must take timers out of the schedule */
+	assert(wl_event_source_timer_update(sources[2], 0) == 0);
+	wl_event_source_remove(sources[3]);
+
+	while (context.count < 2)
+		assert(wl_event_loop_dispatch(loop, 100) == 0);
+	wl_event_loop_dispatch(loop, 20);
+
+	assert(context.count == 2);
+	assert(context.order[0] == 1);
+	assert(context.order[1] == 0);
+
+	for (i = 0; i < 3; i++)
+		wl_event_source_remove(sources[i]);
+	wl_event_loop_destroy(loop);
+}
+
 struct timer_update_context {
 	struct wl_event_source *source1, *source2;
 	int count;
@@ -383,3 +1049,99 @@ TEST(event_loop_destroy)
 	assert(a.done);
 }
 
+struct post_context;
+
+struct post_task_data {
+	struct post_context *context;
+	int id;
+};
+
+struct post_context {
+	struct wl_event_loop *loop;
+	struct post_task_data tasks[3];
+	int order[3];
+	int count;
+};
+
+static void
+post_task(void *data)
+{
+	struct post_task_data *task = data;
+	struct post_context *context = task->context;
+
+	assert(context->count < 3);
+	context->order[context->count++] = task->id;
+}
+
+static void *
+post_thread(void *data)
+{
+	struct post_context *context = data;
+	int i;
+
+	/* post in an order that differs from the array order */
+	for (i = 2; i >= 0; i--)
+		assert(wl_event_loop_post(context->loop, post_task,
+					  &context->tasks[i]) == 0);
+
+	return NULL;
+}
+
+static void *
+run_sync_thread(void *data)
+{
+	struct post_context *context = data;
+
+	assert(wl_event_loop_run_sync(context->loop, post_task,
+				      &context->tasks[0]) == 0);
+	assert(context->count == 1);
+
+	return NULL;
+}
+
+extern int leak_check_enabled;
+
+TEST(event_loop_post)
+{
+	struct post_context context = { 0 };
+	pthread_t thread;
+	int i;
+
+	/* glibc keeps the TLS of exited threads cached along with their
+	 * stacks, which the leak checker would report */
+	leak_check_enabled = 0;
+
+	context.loop = wl_event_loop_create();
+	assert(context.loop);
+
+	for (i = 0; i < 3; i++) {
+		context.tasks[i].context = &context;
+		context.tasks[i].id = 10 + i;
+	}
+
+	/* tasks posted from another thread wake up the loop and run in
+	 * the order they were posted */
+	assert(pthread_create(&thread, NULL, post_thread, &context) == 0);
+	assert(pthread_join(thread, NULL) == 0);
+	assert(context.count == 0);
+	assert(wl_event_loop_dispatch(context.loop, 1000) == 0);
+	assert(context.count == 3);
+	assert(context.order[0] == 12);
+	assert(context.order[1] == 11);
+	assert(context.order[2] == 10);
+
+	context.count = 0;
+	assert(pthread_create(&thread, NULL, run_sync_thread, &context) == 0);
+	while (context.count == 0)
+		assert(wl_event_loop_dispatch(context.loop, 1000) == 0);
+	assert(pthread_join(thread, NULL) == 0);
+	assert(context.order[0] == 10);
+
+	/* whatever is still queued runs when the loop is destroyed */
+	context.count = 0;
+	assert(wl_event_loop_post(context.loop, post_task,
+				  &context.tasks[1]) == 0);
+	wl_event_loop_destroy(context.loop);
+	assert(context.count == 1);
+	assert(context.order[0] == 11);
+}
@@ -25,11 +25,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "wayland-client.h"
 #include "wayland-server.h"
@@ -204,6 +207,726 @@ client_test_queue_roundtrip(void)
 	wl_display_disconnect(display);
 }
 
+#define THREAD_QUEUE_COUNT 4
+#define THREAD_QUEUE_SYNCS 20
+
+struct thread_queue {
+	struct wl_display *display;
+	struct wl_event_queue *queue;
+	int done;
+};
+
+static void
+sync_callback_count(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	struct thread_queue *tq = data;
+
+	tq->done++;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener sync_listener_count = {
+	sync_callback_count
+};
+
+static void *
+thread_dispatch_queue(void *data)
+{
+	struct thread_queue *tq = data;
+
+	while (tq->done < THREAD_QUEUE_SYNCS)
+		assert(wl_display_dispatch_queue(tq->display, tq->queue) >= 0);
+
+	return NULL;
+}
+
+/* Test that several threads can dispatch their own queues at the same
+ * time, each receiving exactly the events of the proxies assigned to it. */
+static void
+client_test_queue_threads(void)
+{
+	struct thread_queue tq[THREAD_QUEUE_COUNT];
+	pthread_t threads[THREAD_QUEUE_COUNT];
+	struct wl_display *display;
+	struct wl_callback *callback;
+	int i, j;
+
+	DISABLE_LEAK_CHECKS;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	/* Assign every callback before anything is flushed, so that no
+	 * event can be queued on the default queue by mistake. */
+	for (i = 0; i < THREAD_QUEUE_COUNT; i++) {
+		tq[i].display = display;
+		tq[i].queue = wl_display_create_queue(display);
+		assert(tq[i].queue);
+		tq[i].done = 0;
+
+		for (j = 0; j < THREAD_QUEUE_SYNCS; j++) {
+			callback = wl_display_sync(display);
+			assert(callback != NULL);
+			wl_proxy_set_queue((struct wl_proxy *) callback,
+					   tq[i].queue);
+			wl_callback_add_listener(callback,
+						 &sync_listener_count, &tq[i]);
+		}
+	}
+
+	for (i = 0; i < THREAD_QUEUE_COUNT; i++)
+		assert(pthread_create(&threads[i], NULL,
+				      thread_dispatch_queue, &tq[i]) == 0);
+
+	for (i = 0; i < THREAD_QUEUE_COUNT; i++) {
+		pthread_join(threads[i], NULL);
+		assert(tq[i].done == THREAD_QUEUE_SYNCS);
+		wl_event_queue_destroy(tq[i].queue);
+	}
+
+	assert(wl_display_dispatch_pending(display) >= 0);
+
+	wl_display_disconnect(display);
+}
+
+#define QUEUE_ORDER_SYNCS 300
+
+struct queue_order_state {
+	int next;
+	bool in_order;
+};
+
+struct queue_order_sync {
+	struct queue_order_state *state;
+	int index;
+};
+
+static void
+sync_callback_order(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	struct queue_order_sync *sync = data;
+
+	if (sync->index != sync->state->next)
+		sync->state->in_order = false;
+	sync->state->next++;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener sync_listener_order = {
+	sync_callback_order
+};
+
+/* Test that events keep their order when a queue holds more of them
+ * than fit in its ring and the rest spill over. */
+static void
+client_test_queue_overflow_order(void)
+{
+	struct queue_order_sync syncs[QUEUE_ORDER_SYNCS];
+	struct queue_order_state state = { 0, true };
+	struct wl_event_queue *queue;
+	struct wl_callback *callback;
+	struct wl_display *display;
+	int i;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	queue = wl_display_create_queue(display);
+	assert(queue);
+
+	for (i = 0; i < QUEUE_ORDER_SYNCS; i++) {
+		syncs[i].state = &state;
+		syncs[i].index = i;
+
+		callback = wl_display_sync(display);
+		assert(callback != NULL);
+		wl_proxy_set_queue((struct wl_proxy *) callback, queue);
+		wl_callback_add_listener(callback, &sync_listener_order,
+					 &syncs[i]);
+
+		/* dispatch a few in between so the ring wraps around */
+		if (i % 100 == 99)
+			assert(wl_display_roundtrip_queue(display, queue) >= 0);
+	}
+
+	while (state.next < QUEUE_ORDER_SYNCS)
+		assert(wl_display_dispatch_queue(display, queue) >= 0);
+
+	assert(state.in_order);
+
+	wl_event_queue_destroy(queue);
+	wl_display_disconnect(display);
+}
+
+/* Test that with the library reader thread running, threads only wait
+ * for their own queues, and that reading falls back to the dispatching
+ * threads once it is stopped. */
+static void
+client_test_queue_read_thread(void)
+{
+	struct thread_queue tq[THREAD_QUEUE_COUNT];
+	pthread_t threads[THREAD_QUEUE_COUNT];
+	struct wl_display *display;
+	struct wl_callback *callback;
+	int i, j;
+
+	DISABLE_LEAK_CHECKS;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	assert(wl_display_start_read_thread(display) == 0);
+	assert(wl_display_start_read_thread(display) == 0);
+
+	for (i = 0; i < THREAD_QUEUE_COUNT; i++) {
+		tq[i].display = display;
+		tq[i].queue = wl_display_create_queue(display);
+		assert(tq[i].queue);
+		tq[i].done = 0;
+
+		for (j = 0; j < THREAD_QUEUE_SYNCS; j++) {
+			callback = wl_display_sync(display);
+			assert(callback != NULL);
+			wl_proxy_set_queue((struct wl_proxy *) callback,
+					   tq[i].queue);
+			wl_callback_add_listener(callback,
+						 &sync_listener_count, &tq[i]);
+		}
+	}
+
+	for (i = 0; i < THREAD_QUEUE_COUNT; i++)
+		assert(pthread_create(&threads[i], NULL,
+				      thread_dispatch_queue, &tq[i]) == 0);
+
+	for (i = 0; i < THREAD_QUEUE_COUNT; i++) {
+		pthread_join(threads[i], NULL);
+		assert(tq[i].done == THREAD_QUEUE_SYNCS);
+		wl_event_queue_destroy(tq[i].queue);
+	}
+
+	assert(wl_display_roundtrip(display) >= 0);
+
+	wl_display_stop_read_thread(display);
+	assert(wl_display_roundtrip(display) >= 0);
+
+	wl_display_disconnect(display);
+}
+
+/* Test that a queue fd becomes readable when the reader thread queues
+ * events on that queue only, and is reset once the queue is dispatched. */
+static void
+client_test_queue_fd(void)
+{
+	struct wl_event_queue *queue, *other;
+	struct wl_callback *callback;
+	struct wl_display *display;
+	struct pollfd pfd[2];
+	bool done = false;
+
+	DISABLE_LEAK_CHECKS;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	queue = wl_display_create_queue(display);
+	assert(queue);
+	other = wl_display_create_queue(display);
+	assert(other);
+
+	pfd[0].fd = wl_event_queue_get_fd(queue);
+	assert(pfd[0].fd >= 0);
+	assert(wl_event_queue_get_fd(queue) == pfd[0].fd);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wl_event_queue_get_fd(other);
+	assert(pfd[1].fd >= 0);
+	pfd[1].events = POLLIN;
+
+	assert(poll(pfd, 2, 0) == 0);
+
+	assert(wl_display_start_read_thread(display) == 0);
+
+	callback = wl_display_sync(display);
+	assert(callback != NULL);
+	wl_proxy_set_queue((struct wl_proxy *) callback, queue);
+	wl_callback_add_listener(callback, &sync_listener_roundtrip, &done);
+	assert(wl_display_flush(display) >= 0);
+
+	assert(poll(pfd, 2, 2000) == 1);
+	assert(pfd[0].revents & POLLIN);
+	assert(!(pfd[1].revents & POLLIN));
+
+	assert(wl_display_dispatch_queue_pending(display, queue) >= 1);
+	assert(done);
+	assert(poll(pfd, 2, 0) == 0);
+
+	wl_callback_destroy(callback);
+	wl_event_queue_destroy(other);
+	wl_event_queue_destroy(queue);
+	wl_display_disconnect(display);
+}
+
+struct coalesce_state {
+	struct wl_seat *seat;
+	int motions, axes, frames;
+	wl_fixed_t x, axis_value;
+};
+
+static void
+coalesce_registry_global(void *data, struct wl_registry *registry,
+			 uint32_t id, const char *interface, uint32_t version)
+{
+	struct coalesce_state *state = data;
+
+	if (strcmp(interface, "wl_seat") == 0)
+		state->seat = wl_registry_bind(registry, id,
+					       &wl_seat_interface, 5);
+}
+
+static const struct wl_registry_listener coalesce_registry_listener = {
+	coalesce_registry_global,
+	NULL
+};
+
+static void
+pointer_enter(void *data, struct wl_pointer *pointer, uint32_t serial,
+	      struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y)
+{
+	assert(0);
+}
+
+static void
+pointer_leave(void *data, struct wl_pointer *pointer, uint32_t serial,
+	      struct wl_surface *surface)
+{
+	assert(0);
+}
+
+static void
+pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time,
+	       wl_fixed_t x, wl_fixed_t y)
+{
+	struct coalesce_state *state = data;
+
+	state->motions++;
+	state->x = x;
+}
+
+static void
+pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial,
+	       uint32_t time, uint32_t button, uint32_t button_state)
+{
+	assert(0);
+}
+
+static void
+pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time,
+	     uint32_t axis, wl_fixed_t value)
+{
+	struct coalesce_state *state = data;
+
+	state->axes++;
+	state->axis_value = value;
+}
+
+static void
+pointer_frame(void *data, struct wl_pointer *pointer)
+{
+	struct coalesce_state *state = data;
+
+	state->frames++;
+}
+
+static const struct wl_pointer_listener coalesce_pointer_listener = {
+	pointer_enter,
+	pointer_leave,
+	pointer_motion,
+	pointer_button,
+	pointer_axis,
+	pointer_frame,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* Test that a coalescing queue folds a backlog of motion and axis
+ * events, each in its own frame, into one event and frame apiece. */
+static void
+client_test_queue_coalescing(void)
+{
+	struct coalesce_state state = { 0 };
+	struct wl_event_queue *queue;
+	struct wl_registry *registry;
+	struct wl_pointer *pointer;
+	struct wl_display *display;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &coalesce_registry_listener,
+				 &state);
+	assert(wl_display_roundtrip(display) >= 0);
+	assert(state.seat);
+
+	queue = wl_display_create_queue(display);
+	assert(queue);
+	wl_event_queue_set_coalescing(queue, 1);
+
+	pointer = wl_seat_get_pointer(state.seat);
+	wl_proxy_set_queue((struct wl_proxy *) pointer, queue);
+	wl_pointer_add_listener(pointer, &coalesce_pointer_listener, &state);
+
+	/* the pointer's queue is not dispatched by this */
+	assert(wl_display_roundtrip(display) >= 0);
+	assert(state.frames == 0);
+
+	assert(wl_display_dispatch_queue_pending(display, queue) >= 0);
+	assert(state.motions == 1);
+	assert(state.x == wl_fixed_from_int(9));
+	assert(state.axes == 1);
+	assert(state.axis_value == wl_fixed_from_int(5));
+	assert(state.frames == 2);
+
+	wl_pointer_destroy(pointer);
+	wl_seat_destroy(state.seat);
+	wl_registry_destroy(registry);
+	wl_event_queue_destroy(queue);
+	wl_display_disconnect(display);
+}
+
+struct touch_state {
+	struct wl_seat *seat;
+	int motions, frames;
+	wl_fixed_t x[2];
+};
+
+static void
+touch_down(void *data, struct wl_touch *touch, uint32_t serial,
+	   uint32_t time, struct wl_surface *surface, int32_t id,
+	   wl_fixed_t x, wl_fixed_t y)
+{
+	assert(0);
+}
+
+static void
+touch_up(void *data, struct wl_touch *touch, uint32_t serial,
+	 uint32_t time, int32_t id)
+{
+	assert(0);
+}
+
+static void
+touch_motion(void *data, struct wl_touch *touch, uint32_t time,
+	     int32_t id, wl_fixed_t x, wl_fixed_t y)
+{
+	struct touch_state *state = data;
+
+	assert(id == 0 || id == 1);
+	state->motions++;
+	state->x[id] = x;
+}
+
+static void
+touch_frame(void *data, struct wl_touch *touch)
+{
+	struct touch_state *state = data;
+
+	/* both points moved in every frame that was sent */
+	assert(state->x[1] == state->x[0] + wl_fixed_from_int(10));
+	state->frames++;
+}
+
+static void
+touch_cancel(void *data, struct wl_touch *touch)
+{
+	assert(0);
+}
+
+static const struct wl_touch_listener coalesce_touch_listener = {
+	touch_down,
+	touch_up,
+	touch_motion,
+	touch_frame,
+	touch_cancel
+};
+
+/* Test that frames with several touch points are folded as a whole,
+ * whatever the order of the points within each frame. */
+static void
+client_test_queue_coalescing_touch(void)
+{
+	struct coalesce_state seat_state = { 0 };
+	struct touch_state state = { 0 };
+	struct wl_event_queue *queue;
+	struct wl_registry *registry;
+	struct wl_touch *touch;
+	struct wl_display *display;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &coalesce_registry_listener,
+				 &seat_state);
+	assert(wl_display_roundtrip(display) >= 0);
+	assert(seat_state.seat);
+
+	queue = wl_display_create_queue(display);
+	assert(queue);
+	wl_event_queue_set_coalescing(queue, 1);
+
+	touch = wl_seat_get_touch(seat_state.seat);
+	wl_proxy_set_queue((struct wl_proxy *) touch, queue);
+	wl_touch_add_listener(touch, &coalesce_touch_listener, &state);
+
+	assert(wl_display_roundtrip(display) >= 0);
+	assert(wl_display_dispatch_queue_pending(display, queue) >= 0);
+	assert(state.motions == 2);
+	assert(state.x[0] == wl_fixed_from_int(4));
+	assert(state.frames == 1);
+
+	wl_touch_destroy(touch);
+	wl_seat_destroy(seat_state.seat);
+	wl_registry_destroy(registry);
+	wl_event_queue_destroy(queue);
+	wl_display_disconnect(display);
+}
+
+static const struct wl_pointer_listener frame_only_pointer_listener = {
+	pointer_enter,
+	pointer_leave,
+	NULL,
+	pointer_button,
+	NULL,
+	pointer_frame,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* Test that events without a handler are dropped while reading when
+ * the proxy asks for it, instead of reaching the NULL listener slot. */
+static void
+client_test_queue_ignore_unhandled(void)
+{
+	struct coalesce_state state = { 0 };
+	struct wl_registry *registry;
+	struct wl_pointer *pointer;
+	struct wl_display *display;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &coalesce_registry_listener,
+				 &state);
+	assert(wl_display_roundtrip(display) >= 0);
+	assert(state.seat);
+
+	pointer = wl_seat_get_pointer(state.seat);
+	wl_pointer_add_listener(pointer, &frame_only_pointer_listener, &state);
+	wl_proxy_set_ignore_unhandled_events((struct wl_proxy *) pointer, 1);
+
+	assert(wl_display_roundtrip(display) >= 0);
+	assert(state.frames == 15);
+
+	wl_pointer_destroy(pointer);
+	wl_seat_destroy(state.seat);
+	wl_registry_destroy(registry);
+	wl_display_disconnect(display);
+}
+
+struct future_chain {
+	struct wl_display *display;
+	struct wl_event_queue *queue;
+	struct wl_sync_future *next;
+};
+
+static void
+sync_future_chain(void *data, struct wl_sync_future *future)
+{
+	struct future_chain *chain = data;
+
+	assert(wl_sync_future_is_done(future));
+	chain->next = wl_display_sync_future(chain->display, chain->queue);
+	assert(chain->next);
+}
+
+static void
+client_test_queue_sync_future(void)
+{
+	struct wl_sync_future *futures[4], *first;
+	struct future_chain chain;
+	struct wl_event_queue *queue;
+	struct wl_display *display;
+	int i;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	queue = wl_display_create_queue(display);
+	assert(queue);
+
+	/* Several outstanding roundtrips are resolved by one wait */
+	for (i = 0; i < 4; i++) {
+		futures[i] = wl_display_sync_future(display, queue);
+		assert(futures[i]);
+		assert(!wl_sync_future_is_done(futures[i]));
+		assert(wl_sync_future_get_serial(futures[i]) == 0);
+	}
+
+	assert(wl_sync_future_wait(futures[3], -1) == 1);
+	for (i = 0; i < 4; i++) {
+		assert(wl_sync_future_is_done(futures[i]));
+		wl_sync_future_destroy(futures[i]);
+	}
+
+	/* A completion callback can chain the next roundtrip */
+	chain.display = display;
+	chain.queue = queue;
+	chain.next = NULL;
+	first = wl_display_sync_future(display, NULL);
+	assert(first);
+	wl_sync_future_set_callback(first, sync_future_chain, &chain);
+	assert(wl_sync_future_wait(first, 2000) == 1);
+	assert(chain.next);
+	assert(wl_sync_future_wait(chain.next, 2000) == 1);
+	wl_sync_future_destroy(chain.next);
+	wl_sync_future_destroy(first);
+
+	/* Destroying a pending future drops its reply */
+	futures[0] = wl_display_sync_future(display, queue);
+	assert(futures[0]);
+	wl_sync_future_destroy(futures[0]);
+	assert(wl_display_roundtrip_queue(display, queue) != -1);
+
+	wl_event_queue_destroy(queue);
+	wl_display_disconnect(display);
+}
+
+static void
+client_test_queue_stats(void)
+{
+	struct wl_display_stats before, after;
+	struct wl_event_queue_stats queue_stats;
+	struct wl_event_queue *queue;
+	struct wl_callback *callbacks[3];
+	struct wl_display *display;
+	int i;
+
+	display = wl_display_connect(NULL);
+	assert(display);
+
+	queue = wl_display_create_queue(display);
+	assert(queue);
+
+	wl_display_get_stats(display, &before);
+
+	for (i = 0; i < 3; i++) {
+		callbacks[i] = wl_display_sync(display);
+		assert(callbacks[i]);
+		wl_proxy_set_queue((struct wl_proxy *) callbacks[i], queue);
+	}
+
+	/* a roundtrip on the default queue reads, but leaves our queue
+	 * alone, so the replies pile up there */
+	assert(wl_display_roundtrip(display) != -1);
+	wl_display_get_stats(display, &after);
+
+	wl_event_queue_get_stats(queue, &queue_stats);
+	assert(queue_stats.events_queued == 3);
+	assert(queue_stats.events_dispatched == 0);
+	assert(queue_stats.depth == 3);
+	assert(queue_stats.max_depth == 3);
+
+	/* four sync requests of 12 bytes each */
+	assert(after.messages_sent == before.messages_sent + 4);
+	assert(after.bytes_sent == before.bytes_sent + 4 * 12);
+	assert(after.flushes > before.flushes);
+	/* as many done and delete_id events */
+	assert(after.messages_received == before.messages_received + 8);
+	assert(after.bytes_received == before.bytes_received + 8 * 12);
+	assert(after.read_wait_ns > before.read_wait_ns);
+
+	/* the callbacks have no listener, so this only empties the queue */
+	assert(wl_display_dispatch_queue_pending(display, queue) == 3);
+	wl_event_queue_get_stats(queue, &queue_stats);
+	assert(queue_stats.events_dispatched == 3);
+	assert(queue_stats.depth == 0);
+	assert(queue_stats.max_depth == 3);
+
+	for (i = 0; i < 3; i++)
+		wl_callback_destroy(callbacks[i]);
+	wl_event_queue_destroy(queue);
+	wl_display_disconnect(display);
+}
+
+static void
+seat_get_pointer(struct wl_client *client, struct wl_resource *resource,
+		 uint32_t id)
+{
+	struct wl_resource *pointer;
+	int i;
+
+	pointer = wl_resource_create(client, &wl_pointer_interface,
+				     wl_resource_get_version(resource), id);
+	assert(pointer);
+
+	for (i = 0; i < 10; i++) {
+		wl_pointer_send_motion(pointer, i, wl_fixed_from_int(i),
+				       wl_fixed_from_int(i));
+		wl_pointer_send_frame(pointer);
+	}
+
+	for (i = 0; i < 5; i++) {
+		wl_pointer_send_axis(pointer, i,
+				     WL_POINTER_AXIS_VERTICAL_SCROLL,
+				     wl_fixed_from_int(1));
+		wl_pointer_send_frame(pointer);
+	}
+}
+
+static void
+seat_get_touch(struct wl_client *client, struct wl_resource *resource,
+	       uint32_t id)
+{
+	struct wl_resource *touch;
+	int i, point;
+
+	touch = wl_resource_create(client, &wl_touch_interface,
+				   wl_resource_get_version(resource), id);
+	assert(touch);
+
+	/* two points per frame, in alternating order */
+	for (i = 0; i < 5; i++) {
+		point = i % 2;
+		wl_touch_send_motion(touch, i, point,
+				     wl_fixed_from_int(i + 10 * point), 0);
+		point = !point;
+		wl_touch_send_motion(touch, i, point,
+				     wl_fixed_from_int(i + 10 * point), 0);
+		wl_touch_send_frame(touch);
+	}
+}
+
+static const struct wl_seat_interface seat_implementation = {
+	seat_get_pointer,
+	NULL,
+	seat_get_touch,
+	NULL
+};
+
+static void
+seat_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &wl_seat_interface, version, id);
+	assert(resource);
+	wl_resource_set_implementation(resource, &seat_implementation,
+				       NULL, NULL);
+}
+
 static void
 dummy_bind(struct wl_client *client,
 	   void *data, uint32_t version, uint32_t id)
@@ -259,3 +982,120 @@ TEST(queue_roundtrip)
 
 	display_destroy(d);
 }
+
+TEST(queue_threads)
+{
+	struct display *d = display_create();
+
+	test_set_timeout(4);
+
+	client_create_noarg(d, client_test_queue_threads);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_overflow_order)
+{
+	struct display *d = display_create();
+
+	test_set_timeout(2);
+
+	client_create_noarg(d, client_test_queue_overflow_order);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_read_thread)
+{
+	struct display *d = display_create();
+
+	test_set_timeout(4);
+
+	client_create_noarg(d, client_test_queue_read_thread);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_fd)
+{
+	struct display *d = display_create();
+
+	test_set_timeout(4);
+
+	client_create_noarg(d, client_test_queue_fd);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_coalescing)
+{
+	struct display *d = display_create();
+
+	wl_global_create(d->wl_display, &wl_seat_interface, 5,
+			 NULL, seat_bind);
+
+	test_set_timeout(2);
+
+	client_create_noarg(d, client_test_queue_coalescing);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_coalescing_touch)
+{
+	struct display *d = display_create();
+
+	wl_global_create(d->wl_display, &wl_seat_interface, 5,
+			 NULL, seat_bind);
+
+	test_set_timeout(2);
+
+	client_create_noarg(d, client_test_queue_coalescing_touch);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_ignore_unhandled)
+{
+	struct display *d = display_create();
+
+	wl_global_create(d->wl_display, &wl_seat_interface, 5,
+			 NULL, seat_bind);
+
+	test_set_timeout(2);
+
+	client_create_noarg(d, client_test_queue_ignore_unhandled);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_sync_future)
+{
+	struct display *d = display_create();
+
+	test_set_timeout(4);
+
+	client_create_noarg(d, client_test_queue_sync_future);
+	display_run(d);
+
+	display_destroy(d);
+}
+
+TEST(queue_stats)
+{
+	struct display *d = display_create();
+
+	test_set_timeout(2);
+
+	client_create_noarg(d, client_test_queue_stats);
+	display_run(d);
+
+	display_destroy(d);
+}
@@ -24,6 +24,8 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -166,3 +168,156 @@ TEST(create_resource_with_same_id)
 	wl_display_destroy(display);
 	close(s[1]);
 }
+
+static void
+limit_handler(struct wl_client *client, enum wl_client_limit limit,
+	      void *data)
+{
+	int *hit = data;
+
+	assert(limit == WL_CLIENT_LIMIT_OBJECTS);
+	(*hit)++;
+}
+
+TEST(resource_limits)
+{
+	struct wl_display *display;
+	struct wl_client *client;
+	struct wl_resource *res, *res2;
+	size_t objects, memory;
+	int s[2];
+	int hit = 0;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	wl_display_set_client_limit_handler(display, limit_handler, &hit);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+
+	/* the display resource is accounted too */
+	objects = wl_client_get_usage(client, WL_CLIENT_LIMIT_OBJECTS);
+	memory = wl_client_get_usage(client, WL_CLIENT_LIMIT_MEMORY);
+	assert(objects == 1);
+	assert(memory > 0);
+
+	assert(wl_client_set_limit(client, WL_CLIENT_LIMIT_OBJECTS,
+				   objects + 1) == 0);
+
+	/* out of range limits are rejected */
+	errno = 0;
+	assert(wl_client_set_limit(client, 3, 1) == -1);
+	assert(errno == EINVAL);
+	errno = 0;
+	assert(wl_client_get_usage(client, 3) == (size_t) -1);
+	assert(errno == EINVAL);
+	errno = 0;
+	assert(wl_display_set_client_limit(display, -1, 1) == -1);
+	assert(errno == EINVAL);
+
+	res = wl_resource_create(client, &wl_seat_interface, 4, 0);
+	assert(res);
+	assert(wl_client_get_usage(client, WL_CLIENT_LIMIT_OBJECTS) == 2);
+	assert(wl_client_get_usage(client, WL_CLIENT_LIMIT_MEMORY) > memory);
+
+	res2 = wl_resource_create(client, &wl_seat_interface, 4, 0);
+	assert(res2 == NULL);
+	assert(hit == 1);
+
+	wl_resource_destroy(res);
+	assert(wl_client_get_usage(client, WL_CLIENT_LIMIT_OBJECTS) == 1);
+	assert(wl_client_get_usage(client, WL_CLIENT_LIMIT_MEMORY) == memory);
+
+	res2 = wl_resource_create(client, &wl_seat_interface, 4, 0);
+	assert(res2);
+	assert(hit == 1);
+
+	wl_client_destroy(client);
+	wl_display_destroy(display);
+	close(s[1]);
+}
+
+static _Bool client_destroyed = 0;
+
+static void
+client_destroy_notify(struct wl_listener *l, void *data)
+{
+	client_destroyed = 1;
+}
+
+static int
+import_seat(struct wl_client *client, const char *interface,
+	    uint32_t version, uint32_t id, void *data)
+{
+	int *imported = data;
+
+	assert(strcmp(interface, "wl_seat") == 0);
+	if (!wl_resource_create(client, &wl_seat_interface, version, id))
+		return -1;
+
+	(*imported)++;
+	return 0;
+}
+
+TEST(client_export_import)
+{
+	struct wl_display *display, *display2;
+	struct wl_client *client;
+	struct wl_resource *res;
+	struct wl_array state, fds;
+	struct wl_listener listener = { .notify = client_destroy_notify };
+	uint32_t buf[6];
+	int s[2];
+	int imported = 0;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	display = wl_display_create();
+	assert(display);
+	client = wl_client_create(display, s[0]);
+	assert(client);
+	wl_client_add_destroy_listener(client, &listener);
+
+	assert(wl_resource_create(client, &wl_seat_interface, 4, 2));
+	res = wl_resource_create(client, &wl_seat_interface, 4, 3);
+	assert(res);
+	wl_resource_destroy(res);
+	res = wl_resource_create(client, &wl_seat_interface, 3, 4);
+	assert(res);
+	wl_seat_send_capabilities(res, WL_SEAT_CAPABILITY_POINTER);
+
+	wl_array_init(&state);
+	wl_array_init(&fds);
+	assert(wl_client_export(client, &state, &fds) == 0);
+	assert(client_destroyed);
+	assert(fds.size == sizeof(int));
+	assert(*(int *) fds.data == s[0]);
+	wl_display_destroy(display);
+
+	display2 = wl_display_create();
+	assert(display2);
+	client = wl_client_import(display2, state.data, state.size,
+				  fds.data, fds.size / sizeof(int),
+				  import_seat, &imported);
+	assert(client);
+	assert(imported == 2);
+
+	res = wl_client_get_object(client, 4);
+	assert(res);
+	assert(wl_resource_get_version(res) == 3);
+	assert(wl_client_get_object(client, 2));
+	assert(wl_client_get_object(client, 3) == NULL);
+
+	/* the unsent delete_id and capabilities events come through */
+	wl_client_flush(client);
+	assert(read(s[1], buf, sizeof buf) == sizeof buf);
+	assert(buf[0] == 1);
+	assert(buf[3] == 4);
+	assert(buf[4] == (12 << 16 | WL_SEAT_CAPABILITIES));
+	assert(buf[5] == WL_SEAT_CAPABILITY_POINTER);
+
+	wl_client_destroy(client);
+	wl_display_destroy(display2);
+	wl_array_release(&state);
+	wl_array_release(&fds);
+	close(s[1]);
+}
@@ -0,0 +1,328 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../cursor/os-compatibility.h"
+#include "wayland-server-core.h"
+#include "wayland-client.h"
+#include "test-runner.h"
+
+#define POOL_SIZE 4096
+
+/* A server and a client talking over a socketpair in the same process,
+ * so that the server side of client buffers can be inspected. */
+struct shm_fixture {
+	struct wl_display *server;
+	struct wl_client *client;
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_shm *shm;
+};
+
+static void
+registry_handle_global(void *data, struct wl_registry *registry,
+		       uint32_t name, const char *interface, uint32_t version)
+{
+	struct shm_fixture *f = data;
+
+	if (strcmp(interface, "wl_shm") == 0)
+		f->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+}
+
+static void
+registry_handle_global_remove(void *data, struct wl_registry *registry,
+			      uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	registry_handle_global,
+	registry_handle_global_remove
+};
+
+/* Let the server handle everything the client sent, and the client
+ * handle the server's replies. */
+static void
+fixture_sync(struct shm_fixture *f)
+{
+	assert(wl_display_flush(f->display) >= 0);
+	assert(wl_event_loop_dispatch(wl_display_get_event_loop(f->server),
+				      0) == 0);
+	wl_display_flush_clients(f->server);
+
+	while (wl_display_prepare_read(f->display) != 0)
+		assert(wl_display_dispatch_pending(f->display) >= 0);
+	assert(wl_display_read_events(f->display) == 0);
+	assert(wl_display_dispatch_pending(f->display) >= 0);
+}
+
+static void
+fixture_init(struct shm_fixture *f)
+{
+	int s[2];
+
+	memset(f, 0, sizeof *f);
+
+	f->server = wl_display_create();
+	assert(f->server);
+	assert(wl_display_init_shm(f->server) == 0);
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s) == 0);
+	f->client = wl_client_create(f->server, s[0]);
+	assert(f->client);
+	f->display = wl_display_connect_to_fd(s[1]);
+	assert(f->display);
+
+	f->registry = wl_display_get_registry(f->display);
+	wl_registry_add_listener(f->registry, &registry_listener, f);
+	fixture_sync(f);
+	assert(f->shm);
+}
+
+static void
+fixture_fini(struct shm_fixture *f)
+{
+	wl_shm_destroy(f->shm);
+	wl_registry_destroy(f->registry);
+	wl_display_disconnect(f->display);
+	wl_client_destroy(f->client);
+	wl_display_destroy(f->server);
+}
+
+static struct wl_shm_buffer *
+get_shm_buffer(struct shm_fixture *f, struct wl_buffer *buffer)
+{
+	struct wl_resource *resource;
+
+	resource = wl_client_get_object(f->client,
+					wl_proxy_get_id((struct wl_proxy *) buffer));
+	assert(resource);
+
+	return wl_shm_buffer_get(resource);
+}
+
+static int
+sigbus_handler_installed(void)
+{
+	struct sigaction action;
+
+	assert(sigaction(SIGBUS, NULL, &action) == 0);
+
+	return action.sa_handler != SIG_DFL;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+static int
+create_sealed_memfd(off_t size)
+{
+	int fd;
+
+	fd = memfd_create("shm-test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	assert(fd >= 0);
+	assert(ftruncate(fd, size) == 0);
+	assert(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0);
+
+	return fd;
+}
+#endif
+
+TEST(shm_sealed_pool_skips_sigbus_handler)
+{
+#ifdef HAVE_MEMFD_CREATE
+	struct shm_fixture f;
+	struct wl_shm_pool *pool;
+	struct wl_buffer *buffer;
+	struct wl_shm_buffer *shm_buffer;
+	uint32_t *data;
+	int fd;
+
+	fixture_init(&f);
+
+	fd = create_sealed_memfd(POOL_SIZE);
+	pool = wl_shm_create_pool(f.shm, fd, POOL_SIZE);
+	close(fd);
+	buffer = wl_shm_pool_create_buffer(pool, 0, 32, 32, 128,
+					   WL_SHM_FORMAT_ARGB8888);
+	fixture_sync(&f);
+
+	shm_buffer = get_shm_buffer(&f, buffer);
+	assert(shm_buffer);
+
+	/* the file cannot shrink, so no SIGBUS handler is needed */
+	wl_shm_buffer_begin_access(shm_buffer);
+	data = wl_shm_buffer_get_data(shm_buffer);
+	assert(data[0] == 0);
+	wl_shm_buffer_end_access(shm_buffer);
+	assert(!sigbus_handler_installed());
+
+	wl_buffer_destroy(buffer);
+	wl_shm_pool_destroy(pool);
+	fixture_fini(&f);
+#endif
+}
+
+TEST(shm_resized_pool_uses_sigbus_handler)
+{
+#ifdef HAVE_MEMFD_CREATE
+	struct shm_fixture f;
+	struct wl_shm_pool *pool;
+	struct wl_buffer *buffer;
+	struct wl_shm_buffer *shm_buffer;
+	uint32_t *data;
+	int fd;
+
+	/* the handler keeps per-thread data until the thread exits */
+	DISABLE_LEAK_CHECKS;
+
+	fixture_init(&f);
+
+	/* grow the pool but not the file, so the new part of the pool
+	 * lies beyond the end of the file */
+	fd = create_sealed_memfd(POOL_SIZE);
+	pool = wl_shm_create_pool(f.shm, fd, POOL_SIZE);
+	close(fd);
+	wl_shm_pool_resize(pool, 2 * POOL_SIZE);
+	buffer = wl_shm_pool_create_buffer(pool, POOL_SIZE, 32, 32, 128,
+					   WL_SHM_FORMAT_ARGB8888);
+	fixture_sync(&f);
+
+	shm_buffer = get_shm_buffer(&f, buffer);
+	assert(shm_buffer);
+
+	/* the access faults and is caught by the SIGBUS handler */
+	wl_shm_buffer_begin_access(shm_buffer);
+	assert(sigbus_handler_installed());
+	data = wl_shm_buffer_get_data(shm_buffer);
+	assert(data[0] == 0);
+	wl_shm_buffer_end_access(shm_buffer);
+
+	wl_buffer_destroy(buffer);
+	wl_shm_pool_destroy(pool);
+	fixture_fini(&f);
+#endif
+}
+
+TEST(shm_grown_pool_skips_sigbus_handler)
+{
+#ifdef HAVE_MEMFD_CREATE
+	struct shm_fixture f;
+	struct wl_shm_pool *pool;
+	struct wl_buffer *buffer;
+	struct wl_shm_buffer *shm_buffer;
+	uint32_t *data;
+	int fd;
+
+	fixture_init(&f);
+
+	/* grow the file before the pool, as cursor themes do */
+	fd = create_sealed_memfd(POOL_SIZE);
+	pool = wl_shm_create_pool(f.shm, fd, POOL_SIZE);
+	assert(ftruncate(fd, 2 * POOL_SIZE) == 0);
+	close(fd);
+	wl_shm_pool_resize(pool, 2 * POOL_SIZE);
+	buffer = wl_shm_pool_create_buffer(pool, POOL_SIZE, 32, 32, 128,
+					   WL_SHM_FORMAT_ARGB8888);
+	fixture_sync(&f);
+
+	shm_buffer = get_shm_buffer(&f, buffer);
+	assert(shm_buffer);
+
+	wl_shm_buffer_begin_access(shm_buffer);
+	data = wl_shm_buffer_get_data(shm_buffer);
+	assert(data[0] == 0);
+	wl_shm_buffer_end_access(shm_buffer);
+	assert(!sigbus_handler_installed());
+
+	wl_buffer_destroy(buffer);
+	wl_shm_pool_destroy(pool);
+	fixture_fini(&f);
+#endif
+}
+
+TEST(shm_pool_resized_during_access)
+{
+#ifdef HAVE_MEMFD_CREATE
+	struct shm_fixture f;
+	struct wl_shm_pool *pool;
+	struct wl_buffer *buffer;
+	struct wl_shm_buffer *shm_buffer;
+	int fd;
+
+	fixture_init(&f);
+
+	fd = create_sealed_memfd(POOL_SIZE);
+	pool = wl_shm_create_pool(f.shm, fd, POOL_SIZE);
+	close(fd);
+	buffer = wl_shm_pool_create_buffer(pool, 0, 32, 32, 128,
+					   WL_SHM_FORMAT_ARGB8888);
+	fixture_sync(&f);
+
+	shm_buffer = get_shm_buffer(&f, buffer);
+	assert(shm_buffer);
+
+	/* the access begins on the fast path, and must end on it even
+	 * though the pool no longer is covered by the file */
+	wl_shm_buffer_begin_access(shm_buffer);
+	wl_shm_pool_resize(pool, 2 * POOL_SIZE);
+	fixture_sync(&f);
+	wl_shm_buffer_end_access(shm_buffer);
+	assert(!sigbus_handler_installed());
+
+	wl_buffer_destroy(buffer);
+	wl_shm_pool_destroy(pool);
+	fixture_fini(&f);
+#endif
+}
+
+TEST(os_create_anonymous_file_seals)
+{
+#ifdef HAVE_MEMFD_CREATE
+	int fd, seals;
+
+	fd = os_create_anonymous_file(POOL_SIZE);
+	assert(fd >= 0);
+
+	seals = fcntl(fd, F_GET_SEALS);
+	assert(seals != -1);
+	assert(seals & F_SEAL_SHRINK);
+
+	/* growing is still allowed, shrinking is not */
+	assert(ftruncate(fd, 2 * POOL_SIZE) == 0);
+	assert(ftruncate(fd, POOL_SIZE) == -1);
+	assert(errno == EPERM);
+
+	close(fd);
+#endif
+}
@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -33,6 +34,8 @@
 #include "wayland-server.h"
 #include "test-runner.h"
 
+#define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+
 /* Paths longer than what the .sun_path array can contain must be rejected.
  * This is a hard limitation of assigning a name to AF_UNIX/AF_LOCAL sockets.
  * See `man 7 unix`.
@@ -173,3 +176,43 @@ TEST(add_socket_auto)
 
 	wl_display_destroy(d);
 }
+
+TEST(accept_connection_burst)
+{
+	const char *name = "wayland-test-burst";
+	struct sockaddr_un addr;
+	struct wl_display *d;
+	int fds[16];
+	int i, before;
+
+	require_xdg_runtime_dir();
+
+	d = wl_display_create();
+	assert(d != NULL);
+	assert(wl_display_add_socket(d, name) == 0);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_LOCAL;
+	snprintf(addr.sun_path, sizeof addr.sun_path, "%s/%s",
+		 getenv("XDG_RUNTIME_DIR"), name);
+
+	for (i = 0; i < (int) ARRAY_LENGTH(fds); i++) {
+		fds[i] = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		assert(fds[i] >= 0);
+		assert(connect(fds[i], (struct sockaddr *) &addr,
+			       sizeof addr) == 0);
+	}
+
+	/* A single wakeup of the listening socket should accept the
+	 * whole backlog, not one client per dispatch. */
+	before = count_open_fds();
+	assert(wl_event_loop_dispatch(wl_display_get_event_loop(d), 0) == 0);
+	assert(count_open_fds() >= before + (int) ARRAY_LENGTH(fds));
+
+	/* hang up so the server destroys the clients */
+	for (i = 0; i < (int) ARRAY_LENGTH(fds); i++)
+		close(fds[i]);
+	assert(wl_event_loop_dispatch(wl_display_get_event_loop(d), 0) == 0);
+
+	wl_display_destroy(d);
+}